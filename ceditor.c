@@ -6,20 +6,66 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* defines */
 #define EDITOR_VERSION "0.0.1"
 #define EDITOR_TAB_STOP 8
 #define EDITOR_QUIT_TIMES 3
+#define ROWS_CHUNK 256  // Rows stored per node of the row tree
+#define TEXT_MIN_BLOCK 16  // Smallest size class of the text allocator
+#define TEXT_CLASSES 13  // Size classes go from 16 bytes up to 64KB
+#define TEXT_MAX_BLOCK (TEXT_MIN_BLOCK << (TEXT_CLASSES - 1))
+#define TEXT_ARENA_SIZE (1 << 20)
+#define RENDER_CACHE_SLOTS 1024  // Rows whose render is kept around
+#define RENDER_SLOT_KEEP (64 * 1024)  // Bigger renders are freed when their slot is reused
+#define SAVE_IOVECS 1024  // Most pieces of the file handed to one writev()
+#define JOURNAL_BUFFER (64 * 1024)  // Journal records held in memory before they're written anyway
+#define JOURNAL_COMMIT_MS 1000  // Longest a journal record waits to be written while typing goes on
+#define UNDO_MEMORY (64 * 1024 * 1024)  // Most the undo log holds before it drops its oldest edits
+#define UNDO_GROUP_MS 1000  // A pause longer than this between keys starts a new undo step
+#define JOURNAL_MAGIC "CEJ1"
+#define JOURNAL_HEADER 28  // Bytes before the first journal record
+#define JOURNAL_RECORD 13  // Bytes of a journal record before its text: op, row, col and text length
+
+#define ROW_CHAR(row, i) ((row)->chars[(i) < (row)->gap ? (i) : (i) + (row)->cap - (row)->size])  // Reads a char of a row around its gap
+
+#define HL_MAX_ROW 4096  // Longer rows aren't syntax highlighted and leave the syntax state as it was
+
+#define MATCH_THREADS_MAX 8  // Most worker threads used to count search matches
+#define MATCH_CACHE_LEVELS 16  // Queries whose matches are kept while the search prompt is up
+#define REGEX_DFA_STATES 1024  // DFA states a regex keeps before starting over
+
+#define INPUT_BUFFER (64 * 1024)  // Bytes of terminal input read ahead
+#define INPUT_ESC_MS 100  // How long the rest of an escape sequence gets to come in
+#define INPUT_PASTE_MS 1000  // A paste that goes quiet this long without its end marker is typed instead
+#define PROGRESS_MS 100  // How often the screen catches up with background work while it runs
+#define STATUS_MESSAGE_SECS 5  // How long a status message stays up
+
+#define FRAME_SKIP 8  // Unchanged cells worth jumping over instead of sending them again
+#define FRAME_CELL_UTF8 ((char)0x80)  // Frame cell holding a multibyte char, which is in its utf8
+#define FRAME_CELL_WIDE ((char)0x81)  // Frame cell taken up by the right half of a wide char
 
 #define CTRL_KEY(k) ((k) & 0x1f)  // A macro to turn alphabet key codes into their CTRL counterparts
 
@@ -34,17 +80,98 @@ enum editorkey{
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  BG_EVENT,  // Not a key, background work has something new to show
+  PASTE_EVENT  // Not a key, the terminal sent a paste and it's in IN.paste
+};
+
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH,  // Search matches
+  HL_STATUS  // Status bar
+};
+
+enum editorSyntaxState {  // What a row leaves open for the rows after it
+  HL_STATE_NORMAL = 0,
+  HL_STATE_COMMENT  // Inside a multi-line comment
+};
+
+enum journalop {  // Edits recorded in the journal, each replays the editor function it's named after
+  JOURNAL_INSERT_ROW = 1,  // editorInsertRow(row, text)
+  JOURNAL_DEL_ROW,  // editorDelRow(row)
+  JOURNAL_INSERT_CHAR,  // editorRowInsertChar() of the one char in text at col
+  JOURNAL_DEL_CHAR,  // editorRowDelChar() at col
+  JOURNAL_APPEND,  // editorRowAppendString(text)
+  JOURNAL_TRUNCATE,  // editorRowTruncate() to col
+  JOURNAL_REPLACE,  // editorReplaceAll(), text is the query (col bytes) and then its replacement
+  JOURNAL_INSERT,  // editorRowInsertString() of text at col
+  JOURNAL_DELETE  // editorRowDelString() of text at col
+};
+
+enum undotype {  // Edits in the undo log
+  UNDO_INSERT = 1,  // text was inserted into row at col
+  UNDO_DELETE,  // text was deleted from row at col
+  UNDO_SPLIT,  // row was split in two at col
+  UNDO_JOIN,  // The row after row was joined onto it, row used to end at col
+  UNDO_ROW,  // A replace changed row, text is what it was before
+  UNDO_REPLACE  // editorReplaceAll(), text is the query (col bytes) and then its replacement
 };
 
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
 /* data */
+enum rowflags {
+  ROW_MAPPED = 1,  // chars points into E.map instead of owning a malloc'd copy
+  ROW_PINNED = 2  // chars is part of a save in progress and has to be copied before it changes
+};
+
 typedef struct erow {  // erow
   int size;
-  int rsize;
-  char *chars;
-  char *render;  // Contains the actual characters to draw on screen
+  int cap;  // Bytes allocated for chars, the gap is the cap - size bytes starting at gap
+  int gap;
+  char *chars;  // Not NUL terminated, use ROW_CHAR() or editorRowChars() to read it
+  int tabs;  // Number of tabs in chars, -1 until someone needs to know, see editorRowScan()
+  int rslot;  // Render cache slot holding the row as drawn on screen, see editorRowRender()
+  unsigned int rgen;
+  int hlstate;  // editorSyntaxState at the end of the row, only valid for rows before E.hlvalid
+  int flags;  // Read by the match counting workers, so only changed while there are none
+  unsigned char utf8;  // chars may have bytes above 0x7f, only known once tabs is. Rows without it are drawn byte for byte
 } erow;
 
+struct editorSyntax {  // Highlighting rules for one language
+  char *filetype;
+  char **filematch;  // Extensions (starting with a dot) or parts of the file name
+  char **keywords;  // Keywords ending with | are highlighted as types
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+};
+
+typedef struct eframe {  // One screenful of character cells, row after row
+  char *chars;
+  uint32_t *utf8;  // The UTF-8 bytes of FRAME_CELL_UTF8 cells, first byte lowest, 0 in the others
+  unsigned char *hl;  // editorHighlight of each cell
+} eframe;
+
+typedef struct rowchunk {  // A node of the row tree, holds a run of consecutive rows
+  struct rowchunk *left, *right;
+  struct rowchunk *prev, *next;  // Neighbouring chunks in file order
+  int priority;  // Random treap priority, parents always have a higher one than their children
+  int count;  // Number of rows in this whole subtree
+  int n;  // Number of rows in this chunk
+  size_t bytes;  // Bytes in this whole subtree, counting a line ending after every row
+  size_t nbytes;  // Bytes in this chunk
+  erow rows[ROWS_CHUNK];
+} rowchunk;
+
 struct editorConfig {
   int cx, cy; // Cursor x and y
   int rx;  // Render x
@@ -53,20 +180,189 @@ struct editorConfig {
   int screenrows;
   int screencols;
   int numrows;
-  erow *row;
+  rowchunk *rows;  // Root of the row tree, use editorRowAt() to get at a row
+  rowchunk *rowcache;  // Chunk of the last row looked up, so sequential lookups don't walk the tree
+  int rowcache_start;  // Index of the first row in rowcache
   int dirty;  // Whether or not the file has been modified since opening/saving
   char *filename;
-  char statusmsg[80];  // Stores a status message such as prompting the user for input when searching
+  struct editorSyntax *syntax;  // NULL if the file type has no highlighting rules
+  int hlvalid;  // Rows before this one have an up to date hlstate, see editorSyntaxStateBefore()
+  char *map;  // Read-only mapping of the file, unedited rows are views into it
+  size_t maplen;
+  char statusmsg[128];  // Stores a status message such as prompting the user for input when searching
   time_t statusmsg_time;  // Timestamp when we set a status message
+  eframe frame;  // Screen being drawn, see editorFlushFrame()
+  eframe lastframe;  // Screen the terminal is showing
+  int framevalid;  // 0 if the terminal's contents are unknown and have to be redrawn
+  int lastrowoff, lastcoloff;  // Offsets lastframe was drawn with
+  int scrollregion;  // Whether the terminal can scroll part of the screen, see editorScrollFrame()
+  int cursory, cursorx;  // Where we last put the terminal's cursor
+  long frames;
+  size_t framebytes;  // Bytes written for the last frame
+  size_t totalbytes;  // Bytes written for every frame so far
   struct termios orig_termios;  // Stores the original terminal settings so we can restore the user's terminal!
 };
 
 struct editorConfig E;
 
+/* filetypes */
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+  "do", "goto", "sizeof", "const", "volatile", "extern", "inline", "register",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "short|", "size_t|", "ssize_t|", NULL
+};
+
+struct editorSyntax HLDB[] = {  // Highlight database
+  {
+    "c",
+    C_HL_extensions,
+    C_HL_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 /* prototypes */
 void editorSetStatusMessage(const char *fmt, ...);
+void editorSyntaxUpdate(int at);
+int matchCountPoll();
+int matchCountStop();
+void matchCountRestart(int forget);
+int editorSavePoll();
+void editorSaveWait();
+char *editorMemSearch(const char *hay, size_t n, const char *q, size_t qlen);
+void editorRowUnpin(erow *row);
+void editorRowFreeChars(erow *row);
+char *editorRowRender(erow *row, int *rsize);
+void editorJournal(int op, int row, int col, const char *s, int len);
+long editorJournalReplay();
+size_t editorJournalMark();
+void editorJournalRebase(const char *filename, size_t mark);
+void editorJournalCommit();
+void editorReplaceAll(const char *q, const char *with);
+int editorWaitForEvent();
+size_t editorReplayKeys(char *buf, size_t cap);
+void editorReplayLatency();
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorStatsDump();
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowempty);
+
+/* stats */
+
+// Counters and timers on the hot paths, cheap enough to be always on. Ctrl-P shows them in the
+// message bar, and CEDITOR_STATS_JSON=FILE writes them to FILE as JSON at exit, see editorStatsDump().
+// Timers are only run on the main thread. The allocation counters count the blocks that go
+// through xmalloc() and the other x functions, which is everything the editor allocates except
+// what getline() and realpath() return, and are bumped from every thread.
+
+enum stattimer {
+  STAT_READKEY,  // Decoding a key, not the wait for it
+  STAT_SCROLL,
+  STAT_DRAWROWS,
+  STAT_WRITE,  // The write() of a frame
+  STAT_UPDATEROW,  // editorUpdateRow() and editorUpdateRowAt()
+  STAT_SAVE,  // How long editorSave() holds up typing
+  STAT_SAVEWRITE,  // A whole background save, from snapshot to rename
+  STAT_TIMERS
+};
+
+const char *STAT_NAMES[STAT_TIMERS] = {"readkey", "scroll", "drawrows", "write", "updaterow", "save", "savewrite"};
+
+struct statTime {
+  long calls;
+  uint64_t ns;
+  uint64_t maxns;
+};
+
+struct stats {
+  struct statTime timers[STAT_TIMERS];
+  long mallocs;  // Calls to xmalloc() and xcalloc(), the string copies included
+  long reallocs;
+  long frees;
+  uint64_t allocated;  // Bytes asked for by all of them
+  int overlay;  // Whether the message bar shows the stats
+};
+
+struct stats ST;
+
+uint64_t statNow() {  // Nanoseconds on the monotonic clock
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void statAddNs(int timer, uint64_t ns) {
+  struct statTime *t = &ST.timers[timer];
+  t->calls++;
+  t->ns += ns;
+  if (ns > t->maxns) t->maxns = ns;
+}
+
+uint64_t statAdd(int timer, uint64_t start) {  // Charges the time since start to timer, returns the time now so timers can follow on
+  uint64_t now = statNow();
+  statAddNs(timer, now - start);
+  return now;
+}
+
+void *xmalloc(size_t size) {  // malloc() that's counted
+  __atomic_fetch_add(&ST.mallocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ST.allocated, size, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+void *xrealloc(void *p, size_t size) {
+  __atomic_fetch_add(&ST.reallocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ST.allocated, size, __ATOMIC_RELAXED);
+  return realloc(p, size);
+}
+
+void *xcalloc(size_t n, size_t size) {
+  __atomic_fetch_add(&ST.mallocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ST.allocated, n * size, __ATOMIC_RELAXED);
+  return calloc(n, size);
+}
+
+char *xstrndup(const char *s, size_t n) {  // strndup() that's counted
+  size_t len = strnlen(s, n);
+  char *p = xmalloc(len + 1);
+  if (p == NULL) return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+char *xstrdup(const char *s) {
+  return xstrndup(s, strlen(s));
+}
+
+void xfree(void *p) {  // Frees what xmalloc() and the rest of them handed out
+  if (p) __atomic_fetch_add(&ST.frees, 1, __ATOMIC_RELAXED);
+  free(p);
+}
+
+int statFormat(char *buf, int size) {  // Writes the one line overlay to buf, returns its length
+  int len = 0, i;
+  for (i = 0; i < STAT_TIMERS && len < size; i++) {
+    struct statTime *t = &ST.timers[i];
+    if (t->calls == 0) continue;
+    double us = t->ns / 1e3 / t->calls;  // Average per call
+    len += snprintf(&buf[len], size - len, us < 1000 ? "%s %.1fus | " : "%s %.1fms | ",
+      STAT_NAMES[i], us < 1000 ? us : us / 1e3);
+  }
+  if (len < size)
+    len += snprintf(&buf[len], size - len, "%ld mallocs %ld reallocs %ld frees %.1fMB",
+      __atomic_load_n(&ST.mallocs, __ATOMIC_RELAXED), __atomic_load_n(&ST.reallocs, __ATOMIC_RELAXED),
+      __atomic_load_n(&ST.frees, __ATOMIC_RELAXED),
+      __atomic_load_n(&ST.allocated, __ATOMIC_RELAXED) / 1e6);
+  return len < size ? len : size - 1;
+}
 
 /* terminal */
 
@@ -79,6 +375,7 @@ void die(const char *s) {
 }
 
 void disableRawMode(){
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);  // Bracketed paste off
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -93,37 +390,171 @@ void enableRawMode() {  // Enables "raw" mode, which allows us to read the user'
   raw.c_cflag |= (CS8);  // Sets character size to 8 bits
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);  // Turns off echo, canonical mode, Ctrl-V and signals
   // Keep in mind that ICANON and ISIG are not input flags for some reason
-  raw.c_cc[VMIN] = 0;  // Sets minimum number of bytes of input before read() can return
-  raw.c_cc[VTIME] = 1;  // maximum amount of time to wait before read() returns
+  raw.c_cc[VMIN] = 0;  // read() returns right away, even with nothing to read. Waiting is done in poll()
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);  // Bracketed paste on, so pastes come in marked and can go in at once
 }
 
-int editorReadKey(){  // Waits for a keypress then returns it
-  int nread;
+// Input is read in chunks of up to INPUT_BUFFER bytes and keys are decoded from the buffer,
+// instead of one read() per byte. A paste comes between \x1b[200~ and \x1b[201~, it's collected whole
+// and handed over as a PASTE_EVENT. If the end marker never shows up, what came is read again
+// as keys, the way it would have been typed without bracketed paste.
+
+struct input {
+  char buf[INPUT_BUFFER];  // The bytes from head up to tail are read but not decoded yet
+  int head;
+  int tail;
+  char *paste;  // The last paste, without its markers
+  int pastelen;
+  int pastecap;
+  char *typed;  // A paste that lost its end marker, read again as keys before anything else
+  int typedlen;
+  int typedpos;
+};
+
+struct input IN;
+
+struct replay {  // Headless runs, see editorReplay()
+  char *keys;  // Key script standing in for the terminal, NULL when there's a terminal
+  size_t len;
+  size_t pos;  // Bytes of it handed to IN so far
+  size_t *pauses;  // Where in keys to wait for the background work, in order
+  int npauses;
+  int pause;  // Pauses waited out so far
+  int rows, cols;  // Size of the pretend screen, 0 when there's a terminal
+  struct timespec keystart;  // When the first byte of the key being handled was read
+  int waiting;  // Whether that key's frame is still to come
+  double *lat;  // Seconds each key took, from reading it to the end of its frame
+  int nlat;
+  int latcap;
+  size_t loaded;  // Bytes in the file opened and how long that took
+  double loadsecs;
+  size_t saved;  // Bytes saved and how long that took
+  double savesecs;
+};
+
+struct replay R;
+
+int editorInputByte(char *c, int timeout) {
+  // Takes the next byte of input, waiting up to timeout ms for it, or for as long as it takes
+  // if timeout is -1. Returns 0 if none came
+  if (IN.typedpos < IN.typedlen) {
+    *c = IN.typed[IN.typedpos++];
+    return 1;
+  }
+  if (IN.head == IN.tail && R.keys) {  // Headless, so the next chunk comes from the key script
+    IN.head = 0;
+    IN.tail = editorReplayKeys(IN.buf, INPUT_BUFFER);
+  }
+  if (IN.head == IN.tail) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) <= 0) return 0;
+    IN.head = IN.tail = 0;  // Empty, so read as much as fits in one go
+    int nread = read(STDIN_FILENO, IN.buf, INPUT_BUFFER);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread == 0 && (pfd.revents & POLLHUP)) die("read");  // The terminal is gone
+    if (nread <= 0) return 0;
+    IN.tail = nread;
+  }
+  *c = IN.buf[IN.head++];
+  if (R.keys && !R.waiting) {  // The start of a key, the clock runs until it's on screen
+    clock_gettime(CLOCK_MONOTONIC, &R.keystart);
+    R.waiting = 1;
+  }
+  return 1;
+}
+
+int editorInputPaste() {
+  // Reads a bracketed paste up to its end marker into IN.paste. Returns 0 if the paste went
+  // quiet before it, then its bytes go to IN.typed instead
+  static const char end[] = "\x1b[201~";
+  IN.pastelen = 0;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1){
-    if (nread == -1 && errno != EAGAIN) die("read");
+  while (editorInputByte(&c, INPUT_PASTE_MS)) {
+    if (IN.pastelen == IN.pastecap) {
+      IN.pastecap = IN.pastecap ? IN.pastecap * 2 : INPUT_BUFFER;
+      IN.paste = xrealloc(IN.paste, IN.pastecap);
+    }
+    IN.paste[IN.pastelen++] = c;
+    if (c == '~' && IN.pastelen >= 6 && memcmp(&IN.paste[IN.pastelen - 6], end, 6) == 0) {
+      IN.pastelen -= 6;
+      return 1;
+    }
   }
+  xfree(IN.typed);  // Anything typed before it was read already
+  IN.typed = IN.paste;
+  IN.typedlen = IN.pastelen;
+  IN.typedpos = 0;
+  IN.paste = NULL;
+  IN.pastelen = IN.pastecap = 0;
+  return 0;
+}
+
+int editorInputPending() {  // Whether there's more input to handle without waiting for it
+  if (IN.typedpos < IN.typedlen || IN.head < IN.tail || (R.keys && R.pos < R.len)) return 1;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+// The main thread sleeps in poll() until there's input or a byte comes down the wake pipe.
+// The SIGWINCH handler and the background threads write one when they have news.
+
+struct wakeup {
+  int pipe[2];  // Read and write ends, both non-blocking
+  volatile sig_atomic_t resized;  // Set by the SIGWINCH handler
+};
+
+struct wakeup W = {{-1, -1}, 0};
+
+void editorWake() {  // Wakes the main thread up, fine to call from signal handlers and other threads
+  int saved = errno;
+  if (W.pipe[1] != -1) write(W.pipe[1], "", 1);  // If the pipe is full there's a wakeup waiting already
+  errno = saved;
+}
+
+void editorHandleResize(int sig) {
+  (void)sig;
+  W.resized = 1;
+  editorWake();
+}
+
+void editorWakeInit() {
+  if (pipe2(W.pipe, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleResize;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
 
+int editorDecodeKey(char c){  // Turns c and the bytes after it into a key
   if (c == '\x1b'){
     char seq[3];  // Stores the characters after the escape sequence
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (!editorInputByte(&seq[0], INPUT_ESC_MS)) return '\x1b';
+    if (!editorInputByte(&seq[1], INPUT_ESC_MS)) return '\x1b';
 
     if (seq[0] == '['){
       if (seq[1] >= '0' && seq[1] <= '9'){  // Checks if the sequence is page up or page down
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b'; // Checks if there is a third byte
+        int n = seq[1] - '0';
+        seq[2] = '\0';
+        while (editorInputByte(&seq[2], INPUT_ESC_MS) && seq[2] >= '0' && seq[2] <= '9')  // The paste markers have 3 digits
+          if (n < 1000) n = n * 10 + seq[2] - '0';
         if (seq[2] == '~'){
-          switch (seq[1]){
-            case '1': return HOME_KEY;  // There are many different ways of representing home and end
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
+          switch (n){
+            case 1: return HOME_KEY;  // There are many different ways of representing home and end
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+            case 200:
+              if (editorInputPaste()) return PASTE_EVENT;
+              return BG_EVENT;  // Nothing to do until its bytes are read as keys
           }
         }
       } else{
@@ -145,8 +576,20 @@ int editorReadKey(){  // Waits for a keypress then returns it
 
     return '\x1b';
   } else {
-    return c;
+    return (unsigned char)c;  // Bytes of UTF-8 chars come out as 128 to 255, below the special keys
+  }
+}
+
+int editorReadKey(){  // Waits for a keypress then returns it
+  char c;
+  while (!editorInputByte(&c, 0)){
+    if (editorWaitForEvent()) return BG_EVENT;  // Something other than a key to show
   }
+
+  uint64_t start = statNow();  // Only from the first byte, the wait for it isn't the editor being slow
+  int key = editorDecodeKey(c);
+  statAdd(STAT_READKEY, start);
+  return key;
 }
 
 int getCursorPosition(int *rows, int *cols) {  // Reads cursor position (fallback for ioctl)
@@ -156,7 +599,7 @@ int getCursorPosition(int *rows, int *cols) {  // Reads cursor position (fallbac
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    if (!editorInputByte(&buf[i], INPUT_ESC_MS)) break;
     if (buf[i] == 'R') break;
     i++;
   }
@@ -171,6 +614,12 @@ int getCursorPosition(int *rows, int *cols) {  // Reads cursor position (fallbac
 int getWindowSize(int *rows, int *cols){  // Use pointers in the arguments to "return" multiple values (this also lets us use the return for error codes
   struct winsize ws;
 
+  if (R.rows) {  // Headless, the screen is whatever size we were told
+    *rows = R.rows;
+    *cols = R.cols;
+    return 0;
+  }
+
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {  // 1 || is temporary, only for testing
     if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;  // C command moves cursor to the right, B moves cursor down (they will stop at edge of screen so we write 999 to make sure it gets there)
     return getCursorPosition(rows, cols);
@@ -181,306 +630,3992 @@ int getWindowSize(int *rows, int *cols){  // Use pointers in the arguments to "r
   }
 }
 
-/* row operations */
+double editorSeconds(struct timespec *since) {  // Seconds gone by since since, on the monotonic clock
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
 
-int editorRowCxToRx(erow *row, int cx) {  // Converts chars index into render index
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
-    rx++;
+/* text allocator */
+
+// Row text and render buffers come from here instead of straight from malloc. Small buffers
+// are rounded up to a power of two size class and carved out of big arenas, and freed blocks
+// go on a free list for their class, so the constant realloc/free churn of editing never
+// reaches malloc. Loads switch on bulk mode, where rows are bump allocated at their exact size.
+// Everything is released at once by textReset(). Build with -DTEXT_PLAIN_MALLOC to compare
+// against plain malloc, the statistics are kept either way.
+
+typedef struct textarena {
+  struct textarena *next;
+  size_t used;
+  size_t size;
+  char data[];
+} textarena;
+
+typedef struct textlarge {  // Header in front of blocks too big for a size class
+  struct textlarge *prev, *next;
+} textlarge;
+
+struct textAllocator {
+  textarena *arenas;  // Current arena first
+  textlarge *large;
+  char *freelist[TEXT_CLASSES];
+  int bulk;  // Nonzero while loading, allocations are exact size bumps
+  struct {
+    long allocs;
+    long frees;
+    long large;  // Allocations that went to malloc
+    size_t requested;  // Bytes asked for
+    size_t inuse;  // Capacity handed out and not freed yet
+    size_t peak;
+    size_t reserved;  // Bytes taken from malloc for arenas and large blocks
+    size_t recycled;  // Allocations served from a free list
+  } stats;
+};
+
+struct textAllocator TA;
+
+int textClass(int size) {  // Smallest class that fits size
+  int cls = 0;
+  while ((TEXT_MIN_BLOCK << cls) < size) cls++;
+  return cls;
+}
+
+char *textBump(size_t size) {  // Takes size bytes off the current arena
+  textarena *a = TA.arenas;
+  if (a == NULL || a->size - a->used < size) {
+    size_t asize = size > TEXT_ARENA_SIZE ? size : TEXT_ARENA_SIZE;
+    a = xmalloc(sizeof(textarena) + asize);
+    if (a == NULL) return NULL;
+    a->next = TA.arenas;
+    a->used = 0;
+    a->size = asize;
+    TA.arenas = a;
+    TA.stats.reserved += sizeof(textarena) + asize;
   }
-  return rx;
+  char *p = &a->data[a->used];
+  a->used += size;
+  return p;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for(cx = 0; cx < row->size; cx++) {
-    if(row->chars[cx] == '\t')
-      cur_rx += (EDITOR_TAB_STOP - 1) - (cur_rx % EDITOR_TAB_STOP);
-    cur_rx++;
+char *textAlloc(int size, int *cap) {  // Returns a block of at least size bytes, *cap gets its real size
+  TA.stats.allocs++;
+  TA.stats.requested += size;
 
-    if (cur_rx > rx) return cx;
+#ifdef TEXT_PLAIN_MALLOC
+  char *p = xmalloc(size ? size : 1);
+  *cap = size;
+#else
+  char *p;
+  if (TA.bulk && size < TEXT_MAX_BLOCK) {
+    p = textBump(size);
+    *cap = size;
+  } else if (size > TEXT_MAX_BLOCK) {
+    textlarge *l = xmalloc(sizeof(textlarge) + size);
+    if (l == NULL) return NULL;
+    l->prev = NULL;
+    l->next = TA.large;
+    if (TA.large) TA.large->prev = l;
+    TA.large = l;
+    TA.stats.large++;
+    TA.stats.reserved += sizeof(textlarge) + size;
+    p = (char *)(l + 1);
+    *cap = size;
+  } else {
+    int cls = textClass(size);
+    p = TA.freelist[cls];
+    if (p) {
+      memcpy(&TA.freelist[cls], p, sizeof(char *));  // Free blocks hold the next pointer, memcpy since they may be unaligned
+      TA.stats.recycled++;
+    } else {
+      p = textBump(TEXT_MIN_BLOCK << cls);
+    }
+    *cap = TEXT_MIN_BLOCK << cls;
   }
-  return cx;
+#endif
+
+  TA.stats.inuse += *cap;
+  if (TA.stats.inuse > TA.stats.peak) TA.stats.peak = TA.stats.inuse;
+  return p;
 }
 
-void editorUpdateRow(erow *row) {
-  // Fills up the render array with characters
-  int tabs = 0;
+void textFree(char *p, int cap) {  // cap has to be the capacity textAlloc() reported
+  if (p == NULL) return;
+  TA.stats.frees++;
+  TA.stats.inuse -= cap;
+
+#ifdef TEXT_PLAIN_MALLOC
+  xfree(p);
+#else
+  if (cap > TEXT_MAX_BLOCK) {
+    textlarge *l = (textlarge *)p - 1;
+    if (l->prev) l->prev->next = l->next;
+    else TA.large = l->next;
+    if (l->next) l->next->prev = l->prev;
+    TA.stats.reserved -= sizeof(textlarge) + cap;
+    xfree(l);
+    return;
+  }
+  if (cap < TEXT_MIN_BLOCK) return;  // Too small to hold a free list link, it comes back with textReset()
+
+  int cls = textClass(cap);
+  if ((TEXT_MIN_BLOCK << cls) > cap) cls--;  // Bump allocated blocks can be any size, file them under the class they cover
+  memcpy(p, &TA.freelist[cls], sizeof(char *));
+  TA.freelist[cls] = p;
+#endif
+}
+
+char *textRealloc(char *p, int oldcap, int size, int *cap) {  // Like realloc, keeps min(oldcap, size) bytes
+  char *new = textAlloc(size, cap);
+  if (new == NULL) return NULL;
+  if (p) {
+    memcpy(new, p, oldcap < size ? oldcap : size);
+    textFree(p, oldcap);
+  }
+  return new;
+}
+
+void textReset() {  // Releases every block at once, all rows must be gone or about to be dropped
+  while (TA.arenas) {
+    textarena *next = TA.arenas->next;
+    xfree(TA.arenas);
+    TA.arenas = next;
+  }
+  while (TA.large) {
+    textlarge *next = TA.large->next;
+    xfree(TA.large);
+    TA.large = next;
+  }
+  memset(TA.freelist, 0, sizeof(TA.freelist));
+  TA.stats.inuse = 0;
+  TA.stats.reserved = 0;
+}
+
+/* row storage */
+
+// Rows are kept in chunks of up to ROWS_CHUNK rows, and the chunks are the nodes of a treap
+// ordered by position in the file. Each node counts the rows in its subtree, so finding,
+// inserting or deleting a row is O(log n) plus a memmove inside a single chunk. Nodes also add
+// up the bytes of their subtree, which turns byte offsets into rows and back in O(log n) too.
+// Offsets are into the file as it would be saved, with a \n after every row.
+
+rowchunk *rowChunkNew() {
+  rowchunk *c = xmalloc(sizeof(rowchunk));
+  c->left = c->right = NULL;
+  c->prev = c->next = NULL;
+  c->priority = rand();
+  c->count = 0;
+  c->n = 0;
+  c->bytes = c->nbytes = 0;
+  return c;
+}
+
+int rowTreeCount(rowchunk *t) {
+  return t ? t->count : 0;
+}
+
+size_t rowTreeBytes(rowchunk *t) {
+  return t ? t->bytes : 0;
+}
+
+void rowTreeFix(rowchunk *t) {  // Recomputes the row and byte counts after t's children changed
+  t->count = rowTreeCount(t->left) + t->n + rowTreeCount(t->right);
+  t->bytes = rowTreeBytes(t->left) + t->nbytes + rowTreeBytes(t->right);
+}
+
+size_t rowChunkBytes(rowchunk *c, int from, int to) {  // Bytes in rows from up to to of a chunk
+  size_t bytes = 0;
   int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+  for (j = from; j < to; j++) bytes += c->rows[j].size + 1;
+  return bytes;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (EDITOR_TAB_STOP - 1) + 1);
+rowchunk *rowTreeRotateRight(rowchunk *t) {  // Lifts the left child above t
+  rowchunk *l = t->left;
+  t->left = l->right;
+  l->right = t;
+  rowTreeFix(t);
+  rowTreeFix(l);
+  return l;
+}
 
-  int idx = 0; // Number of characters in row->render
-  for (j = 0; j < row->size; j++){
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while(idx % EDITOR_TAB_STOP != 0) row->render[idx++] = ' ';  // Add spaces until tab stop (column divisible by 8)
+rowchunk *rowTreeRotateLeft(rowchunk *t) {  // Lifts the right child above t
+  rowchunk *r = t->right;
+  t->right = r->left;
+  r->left = t;
+  rowTreeFix(t);
+  rowTreeFix(r);
+  return r;
+}
+
+rowchunk *rowTreeInsertFront(rowchunk *t, rowchunk *c) {  // Links c in before every chunk of subtree t
+  if (t == NULL) {
+    rowTreeFix(c);
+    return c;
+  }
+  t->left = rowTreeInsertFront(t->left, c);
+  rowTreeFix(t);
+  if (t->left->priority > t->priority) t = rowTreeRotateRight(t);
+  return t;
+}
+
+rowchunk *rowTreeInsertBack(rowchunk *t, rowchunk *c) {  // Links c in after every chunk of subtree t
+  if (t == NULL) {
+    rowTreeFix(c);
+    return c;
+  }
+  t->right = rowTreeInsertBack(t->right, c);
+  rowTreeFix(t);
+  if (t->right->priority > t->priority) t = rowTreeRotateLeft(t);
+  return t;
+}
+
+rowchunk *rowTreeInsert(rowchunk *t, int at, erow *row) {  // Inserts a copy of *row so it ends up at index at
+  if (t == NULL) {  // Empty tree
+    t = rowChunkNew();
+    t->rows[t->n++] = *row;
+    t->nbytes = row->size + 1;
+    rowTreeFix(t);
+    return t;
+  }
+
+  int lcount = rowTreeCount(t->left);
+  if (at < lcount) {
+    t->left = rowTreeInsert(t->left, at, row);
+    rowTreeFix(t);
+    if (t->left->priority > t->priority) t = rowTreeRotateRight(t);
+    return t;
+  }
+  at -= lcount;
+  if (at > t->n) {
+    t->right = rowTreeInsert(t->right, at - t->n, row);
+    rowTreeFix(t);
+    if (t->right->priority > t->priority) t = rowTreeRotateLeft(t);
+    return t;
+  }
+
+  if (t->n == ROWS_CHUNK) {  // Chunk is full, so split it and link the new half in right after it
+    rowchunk *c = rowChunkNew();
+    int keep = (at == t->n) ? t->n : ROWS_CHUNK / 2;  // Appending to a chunk starts a fresh one so loads fill chunks up
+    c->n = t->n - keep;
+    memcpy(c->rows, &t->rows[keep], sizeof(erow) * c->n);
+    t->n = keep;
+    c->nbytes = rowChunkBytes(c, 0, c->n);
+    t->nbytes -= c->nbytes;
+
+    c->prev = t;
+    c->next = t->next;
+    if (t->next) t->next->prev = c;
+    t->next = c;
+
+    if (at > t->n || t->n == ROWS_CHUNK) {  // Row goes into the new chunk
+      at -= t->n;
+      memmove(&c->rows[at + 1], &c->rows[at], sizeof(erow) * (c->n - at));
+      c->rows[at] = *row;
+      c->n++;
+      c->nbytes += row->size + 1;
     } else {
-      row->render[idx++] = row->chars[j];
+      memmove(&t->rows[at + 1], &t->rows[at], sizeof(erow) * (t->n - at));
+      t->rows[at] = *row;
+      t->n++;
+      t->nbytes += row->size + 1;
     }
+
+    t->right = rowTreeInsertFront(t->right, c);
+    rowTreeFix(t);
+    if (t->right->priority > t->priority) t = rowTreeRotateLeft(t);
+    return t;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+
+  memmove(&t->rows[at + 1], &t->rows[at], sizeof(erow) * (t->n - at));
+  t->rows[at] = *row;
+  t->n++;
+  t->nbytes += row->size + 1;
+  rowTreeFix(t);
+  return t;
 }
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+rowchunk *rowTreeMerge(rowchunk *a, rowchunk *b) {  // Joins two subtrees where all of a comes before b
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->priority > b->priority) {
+    a->right = rowTreeMerge(a->right, b);
+    rowTreeFix(a);
+    return a;
+  }
+  b->left = rowTreeMerge(a, b->left);
+  rowTreeFix(b);
+  return b;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+rowchunk *rowTreeDelete(rowchunk *t, int at) {  // Removes the row at index at, its contents must already be freed
+  int lcount = rowTreeCount(t->left);
+  if (at < lcount) {
+    t->left = rowTreeDelete(t->left, at);
+    rowTreeFix(t);
+    return t;
+  }
+  at -= lcount;
+  if (at >= t->n) {
+    t->right = rowTreeDelete(t->right, at - t->n);
+    rowTreeFix(t);
+    return t;
+  }
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+  t->nbytes -= t->rows[at].size + 1;
+  memmove(&t->rows[at], &t->rows[at + 1], sizeof(erow) * (t->n - at - 1));
+  t->n--;
+  if (t->n == 0) {  // Drop empty chunks from the tree and the chunk list
+    rowchunk *merged = rowTreeMerge(t->left, t->right);
+    if (t->prev) t->prev->next = t->next;
+    if (t->next) t->next->prev = t->prev;
+    xfree(t);
+    return merged;
+  }
+  rowTreeFix(t);
+  return t;
+}
 
-  E.numrows++;
-  E.dirty++;
+rowchunk *rowTreeFind(rowchunk *t, int *at) {  // Finds the chunk holding row *at and turns *at into an index into it
+  while (t) {
+    int lcount = rowTreeCount(t->left);
+    if (*at < lcount) {
+      t = t->left;
+    } else if (*at < lcount + t->n) {
+      *at -= lcount;
+      return t;
+    } else {
+      *at -= lcount + t->n;
+      t = t->right;
+    }
+  }
+  return NULL;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+void rowTreeResized(rowchunk *t, int at) {  // Counts the bytes again on the way down to row at, after it changed size
+  if (t == NULL) return;
+  int lcount = rowTreeCount(t->left);
+  if (at < lcount) rowTreeResized(t->left, at);
+  else if (at >= lcount + t->n) rowTreeResized(t->right, at - lcount - t->n);
+  else t->nbytes = rowChunkBytes(t, 0, t->n);
+  rowTreeFix(t);
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+void rowTreeFixAll(rowchunk *t) {  // Counts every subtree again, for after rows all over the file changed size
+  if (t == NULL) return;
+  rowTreeFixAll(t->left);
+  rowTreeFixAll(t->right);
+  rowTreeFix(t);
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+size_t rowTreeOffset(rowchunk *t, int at) {  // Returns the byte offset where row at starts
+  size_t offset = 0;
+  while (t) {
+    int lcount = rowTreeCount(t->left);
+    if (at < lcount) {
+      t = t->left;
+    } else if (at < lcount + t->n) {
+      return offset + rowTreeBytes(t->left) + rowChunkBytes(t, 0, at - lcount);
+    } else {
+      offset += rowTreeBytes(t->left) + t->nbytes;
+      at -= lcount + t->n;
+      t = t->right;
+    }
+  }
+  return offset;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+int rowTreeFindOffset(rowchunk *t, size_t *offset) {
+  // Returns the row byte *offset falls in and turns *offset into a column of it. Offsets past
+  // the end of the file land on the end of the last row
+  int at = 0;
+  while (t) {
+    size_t lbytes = rowTreeBytes(t->left);
+    if (*offset < lbytes) {
+      t = t->left;
+    } else if (*offset < lbytes + t->nbytes || t->right == NULL) {
+      *offset -= lbytes;
+      at += rowTreeCount(t->left);
+      int j;
+      for (j = 0; j < t->n - 1 && *offset > (size_t)t->rows[j].size; j++) *offset -= t->rows[j].size + 1;
+      if (*offset > (size_t)t->rows[j].size) *offset = t->rows[j].size;
+      return at + j;
+    } else {
+      *offset -= lbytes + t->nbytes;
+      at += rowTreeCount(t->left) + t->n;
+      t = t->right;
+    }
+  }
+  return 0;
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+erow *editorRowAt(int at) {  // Returns row at, or NULL. Only valid until the next row insert or delete
+  if (at < 0 || at >= E.numrows) return NULL;
+
+  rowchunk *c = E.rowcache;
+  if (c) {  // Walking rows in order only ever steps to the neighbouring chunk
+    int start = E.rowcache_start;
+    if (at >= start + c->n && c->next) {
+      start += c->n;
+      c = c->next;
+    } else if (at < start && c->prev) {
+      c = c->prev;
+      start -= c->n;
+    }
+    if (at >= start && at < start + c->n) {
+      E.rowcache = c;
+      E.rowcache_start = start;
+      return &c->rows[at - start];
+    }
+  }
+
+  int idx = at;
+  c = rowTreeFind(E.rows, &idx);
+  E.rowcache = c;
+  E.rowcache_start = at - idx;
+  return &c->rows[idx];
 }
 
-/* editor operations */
+/* render cache */
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {  // If cursor is on a new line then insert a row
-    editorInsertRow(E.numrows, "", 0);
+// Only rows with tabs or multibyte chars need a render that differs from chars, and only rows
+// that are drawn need one at all. Those renders live in a fixed number of slots that are reused
+// least recently used first. A row owns its slot only while rgen matches the slot's generation,
+// so giving the slot to another row needs no pointer back to the old one. When the file has
+// syntax highlighting, the slot also keeps the colors of the row, so every drawn row has one.
+// Along with the render the slot lists the row's tabs and multibyte chars, which turns chars
+// indexes into render columns and back with a binary search instead of a walk along the row.
+// Everything between two entries of that index is one byte and one column per char.
+
+typedef struct renderchar {  // A char of the row that isn't one byte wide and one column long
+  int cx;  // Index of its first byte in chars
+  int rx;  // Render column right after it
+  int rb;  // Render byte right after it, the same as rx in a row without multibyte chars
+  unsigned char len;  // Bytes it takes in chars, 1 for a tab
+  unsigned char width;  // Columns it takes on screen, 0 for a combining mark
+} renderchar;
+
+typedef struct renderslot {
+  char *render;
+  int rcap;
+  int rsize;  // -1 until the row it belongs to is rendered into it
+  renderchar *index;  // Every tab and multibyte char of the row in order, valid whenever render is
+  int nindex;
+  int indexcap;  // Bytes allocated for index
+  unsigned char *hl;  // editorHighlight of each render byte
+  int hlcap;
+  int hlstart;  // Syntax state hl was computed from, -1 if the row changed since
+  unsigned int gen;  // Bumped every time the slot changes hands
+  int prev, next;  // LRU list, the head is the most recently used slot
+} renderslot;
+
+struct renderCache {
+  renderslot slots[RENDER_CACHE_SLOTS];
+  int head, tail;
+  char *scratch;  // Holds a slice of a row that straddles its gap
+  int scratchcap;
+  long hits, misses;
+};
+
+struct renderCache RC;
+
+void renderCacheUnlink(int i) {
+  renderslot *slot = &RC.slots[i];
+  if (slot->prev != -1) RC.slots[slot->prev].next = slot->next;
+  else RC.head = slot->next;
+  if (slot->next != -1) RC.slots[slot->next].prev = slot->prev;
+  else RC.tail = slot->prev;
+}
+
+void renderCachePush(int i, int front) {  // Links slot i in as most (front) or least recently used
+  renderslot *slot = &RC.slots[i];
+  if (front) {
+    slot->prev = -1;
+    slot->next = RC.head;
+    if (RC.head != -1) RC.slots[RC.head].prev = i;
+    RC.head = i;
+    if (RC.tail == -1) RC.tail = i;
+  } else {
+    slot->next = -1;
+    slot->prev = RC.tail;
+    if (RC.tail != -1) RC.slots[RC.tail].next = i;
+    RC.tail = i;
+    if (RC.head == -1) RC.head = i;
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);  // Add the character
-  E.cx++;
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {  // If we are at the beginning
-    editorInsertRow(E.cy, "", 0);
-  } else {  // We are splitting a row into 2
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];  // Move call this again because we called realloc in editorInsertRow, which might invalidate the pointer
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+void renderCacheInit() {
+  int i;
+  RC.head = RC.tail = -1;
+  for (i = 0; i < RENDER_CACHE_SLOTS; i++) {
+    RC.slots[i].render = NULL;
+    RC.slots[i].rcap = 0;
+    RC.slots[i].rsize = -1;
+    RC.slots[i].index = NULL;
+    RC.slots[i].indexcap = 0;
+    RC.slots[i].hl = NULL;
+    RC.slots[i].hlcap = 0;
+    RC.slots[i].hlstart = -1;
+    RC.slots[i].gen++;  // Invalidates any row that still points here
+    renderCachePush(i, 0);
   }
-  E.cy++;
-  E.cx = 0;
 }
 
-void editorDelChar() {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+renderslot *renderCacheGet(erow *row) {  // Returns the row's slot, or NULL if it lost it
+  if (row->rslot < 0 || RC.slots[row->rslot].gen != row->rgen) return NULL;
+  return &RC.slots[row->rslot];
+}
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+renderslot *renderCacheTake(erow *row) {  // Hands the least recently used slot to row
+  int i = RC.tail;
+  renderslot *slot = &RC.slots[i];
+  slot->gen++;
+  if (slot->rcap > RENDER_SLOT_KEEP) {  // Don't let one huge line pin its buffer forever
+    textFree(slot->render, slot->rcap);
+    slot->render = NULL;
+    slot->rcap = 0;
+  }
+  if (slot->hlcap > RENDER_SLOT_KEEP) {
+    textFree((char *)slot->hl, slot->hlcap);
+    slot->hl = NULL;
+    slot->hlcap = 0;
+  }
+  if (slot->indexcap > RENDER_SLOT_KEEP) {
+    textFree((char *)slot->index, slot->indexcap);
+    slot->index = NULL;
+    slot->indexcap = 0;
   }
+  slot->rsize = -1;
+  slot->hlstart = -1;
+  row->rslot = i;
+  row->rgen = slot->gen;
+  return slot;
 }
 
-/* file i/o */
+void renderSlotReserveIndex(renderslot *slot, int n) {  // Makes room for n index entries, keeping the ones listed
+  if ((size_t)n * sizeof(renderchar) <= (size_t)slot->indexcap) return;
+  int size = n * sizeof(renderchar);
+  if (size < slot->indexcap * 2) size = slot->indexcap * 2;
+  slot->index = (renderchar *)textRealloc((char *)slot->index, slot->indexcap, size, &slot->indexcap);
+}
 
-char *editorRowsToString(int *buflen) {  // converts array of erow into single string
-  // buflen tells the caller how long the string is
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;  // add one for newline
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+void renderSlotAddIndex(renderslot *slot, int cx, int len, int rx, int rb, int width) {  // Lists one more char at the end of the index
+  renderSlotReserveIndex(slot, slot->nindex + 1);
+  renderchar *e = &slot->index[slot->nindex++];
+  e->cx = cx;
+  e->len = len;
+  e->rx = rx;
+  e->rb = rb;
+  e->width = width;
+}
+
+int renderSlotIndexBefore(renderslot *slot, int cx) {  // Returns how many index entries start before chars index cx
+  int lo = 0, hi = slot->nindex;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (slot->index[mid].cx < cx) lo = mid + 1;
+    else hi = mid;
   }
+  return lo;
+}
 
-  return buf;  // caller must free the memory
+void renderCacheTouch(int i) {
+  if (RC.head == i) return;
+  renderCacheUnlink(i);
+  renderCachePush(i, 1);
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+void renderCacheRelease(erow *row) {  // Gives the row's slot back, it's the next one to be reused
+  renderslot *slot = renderCacheGet(row);
+  row->rslot = -1;
+  if (slot == NULL) return;
+  slot->gen++;
+  renderCacheUnlink(slot - RC.slots);
+  renderCachePush(slot - RC.slots, 0);
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+void renderCacheReset() {  // Forgets every render, their memory is released with the text allocator
+  renderCacheInit();
+  xfree(RC.scratch);  // Except the scratch buffer, which isn't the text allocator's
+  RC.scratch = NULL;
+  RC.scratchcap = 0;
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1){
+/* utf-8 */
+
+// Text is taken as UTF-8. A row is first only checked for being plain ASCII, 16 bytes at a
+// time, and rows that are go on being drawn byte for byte. The others are decoded when they
+// are rendered, and bytes that don't decode are drawn as '?' without being touched. How many
+// columns a char takes comes from the tables below, a short take on wcwidth() that doesn't
+// depend on the locale.
+
+const int UTF8_ZERO_WIDTH[][2] = {  // Combining marks and invisible format chars
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+  {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+  {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902},
+  {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+  {0x0962, 0x0963}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1160, 0x11FF},
+  {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+  {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0001, 0xE007F},
+  {0xE0100, 0xE01EF}
+};
+
+const int UTF8_WIDE[][2] = {  // East Asian wide and fullwidth chars, and emoji
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+  {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+  {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+  {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+  {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+  {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+  {0x2E80, 0x303E}, {0x3041, 0x4DBF}, {0x4E00, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3},
+  {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6},
+  {0x16FE0, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+  {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F2FF}, {0x1F300, 0x1F64F},
+  {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+  {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+int editorUtf8InRanges(int cp, const int ranges[][2], int n) {  // Binary search of a sorted table
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < ranges[mid][0]) hi = mid - 1;
+    else if (cp > ranges[mid][1]) lo = mid + 1;
+    else return 1;
+  }
+  return 0;
+}
+
+int editorCharWidth(int cp) {  // Columns codepoint cp takes on screen
+  if (cp < 0x300) return 1;
+  if (editorUtf8InRanges(cp, UTF8_ZERO_WIDTH, sizeof(UTF8_ZERO_WIDTH) / sizeof(UTF8_ZERO_WIDTH[0]))) return 0;
+  if (cp >= 0x1100 && editorUtf8InRanges(cp, UTF8_WIDE, sizeof(UTF8_WIDE) / sizeof(UTF8_WIDE[0]))) return 2;
+  return 1;
+}
+
+int editorUtf8Decode(const char *s, int len, int *cp) {
+  // Decodes the char at the start of s, which has len bytes, and returns how many bytes it
+  // takes. A byte that doesn't start a valid char (overlong, a surrogate, past U+10FFFF or cut
+  // short) comes back as a char of its own with *cp -1
+  const unsigned char *u = (const unsigned char *)s;
+  int n, c;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  }
+  if (u[0] >= 0xC2 && u[0] <= 0xDF) { n = 2; c = u[0] & 0x1F; }
+  else if (u[0] >= 0xE0 && u[0] <= 0xEF) { n = 3; c = u[0] & 0x0F; }
+  else if (u[0] >= 0xF0 && u[0] <= 0xF4) { n = 4; c = u[0] & 0x07; }
+  else n = 0;
+  if (n == 0 || n > len) {
+    *cp = -1;
+    return 1;
+  }
+  int i;
+  for (i = 1; i < n; i++) {
+    if ((u[i] & 0xC0) != 0x80) {
+      *cp = -1;
+      return 1;
+    }
+    c = c << 6 | (u[i] & 0x3F);
+  }
+  if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) || (n == 4 && (c < 0x10000 || c > 0x10FFFF))) {
+    *cp = -1;
+    return 1;
+  }
+  *cp = c;
+  return n;
+}
+
+int editorIsAscii(const char *s, size_t len) {  // Whether no byte of s is above 0x7f
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16)  // The top bits of 16 bytes at once
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) return 0;
+#endif
+  for (; i < len; i++)
+    if (s[i] & 0x80) return 0;
+  return 1;
+}
+
+/* row operations */
+
+// Edited rows keep their text in a gap buffer: chars[0..gap) is the text before the gap and
+// the last size - gap bytes of the allocation are the text after it. Edits happen at the gap,
+// so typing or deleting at the same spot only moves the gap once. Mapped rows have no gap.
+
+int editorRowFindTab(erow *row, int from, int to) {  // Returns the index of the first tab in [from, to), or to
+  int gaplen = row->cap - row->size;
+  if (from < row->gap) {
+    int end = to < row->gap ? to : row->gap;
+    char *t = memchr(&row->chars[from], '\t', end - from);
+    if (t) return t - row->chars;
+    from = end;
+  }
+  if (from < to) {
+    char *t = memchr(&row->chars[from + gaplen], '\t', to - from);
+    if (t) return t - row->chars - gaplen;
+  }
+  return to;
+}
+
+int editorRowCountTabs(erow *row, int from, int to) {
+  int tabs = 0;
+  while ((from = editorRowFindTab(row, from, to)) < to) {
+    tabs++;
+    from++;
+  }
+  return tabs;
+}
+
+void editorRowScan(erow *row) {
+  // Counts the tabs of a row and finds out whether it has multibyte chars. Rows of a file
+  // that was just opened are only looked at like this once they're needed
+  int gaplen = row->cap - row->size;
+  row->tabs = editorRowCountTabs(row, 0, row->size);
+  if (editorIsAscii(row->chars, row->gap) && editorIsAscii(&row->chars[row->gap + gaplen], row->size - row->gap))
+    row->utf8 = 0;
+  else
+    row->utf8 = 1;
+}
+
+int editorRowIsUtf8(erow *row) {
+  if (row->tabs < 0) editorRowScan(row);
+  return row->utf8;
+}
+
+int editorRowDecode(erow *row, int at, int *cp) {
+  // editorUtf8Decode() of the char at index at of a row. C1 control chars would be taken as
+  // escape codes by the terminal, so they count as stray bytes too and each byte shows as '?'
+  char buf[4];
+  int len = row->size - at < 4 ? row->size - at : 4;
+  int i;
+  for (i = 0; i < len; i++) buf[i] = ROW_CHAR(row, at + i);
+  len = editorUtf8Decode(buf, len, cp);
+  if (*cp >= 0x80 && *cp < 0xA0) {
+    *cp = -1;
+    return 1;
+  }
+  return len;
+}
+
+renderslot *editorRowIndex(erow *row) {
+  // Returns the slot whose index covers the row, or NULL if there's none. The columns of a row
+  // with multibyte chars can't be counted without decoding it, so that one is rendered if needed
+  renderslot *slot = renderCacheGet(row);
+  if ((slot == NULL || slot->rsize < 0) && row->utf8) {
+    int rsize;
+    editorRowRender(row, &rsize);
+    slot = renderCacheGet(row);
+  }
+  return slot && slot->rsize >= 0 ? slot : NULL;
+}
+
+int editorRowCxToRx(erow *row, int cx) {  // Converts chars index into render index
+  if (row->tabs < 0) editorRowScan(row);
+  if (row->tabs == 0 && !row->utf8) return cx;  // Every char is one column
+  renderslot *slot = editorRowIndex(row);
+  if (slot) {  // Count on from the end of the last tab or multibyte char before cx
+    int k = renderSlotIndexBefore(slot, cx);
+    if (k == 0) return cx;
+    renderchar *e = &slot->index[k - 1];
+    if (cx < e->cx + e->len) return e->rx - e->width;  // cx is inside that char, so it's where the char starts
+    return e->rx + (cx - e->cx - e->len);
+  }
+
+  int rx = 0;
+  int j = 0;
+  while (j < cx) {  // Jump from tab to tab, everything in between is one column per char
+    int tab = editorRowFindTab(row, j, cx);
+    rx += tab - j;
+    if (tab == cx) break;
+    rx += EDITOR_TAB_STOP - (rx % EDITOR_TAB_STOP);
+    j = tab + 1;
+  }
+  return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  if (row->tabs < 0) editorRowScan(row);
+  if (row->tabs == 0 && !row->utf8) return rx < row->size ? rx : row->size;
+  renderslot *slot = editorRowIndex(row);
+  if (slot) {
+    // Find the last entry that ends at or before rx. rx is in the plain chars after it, unless
+    // those run out first and it's in the next entry or past the end
+    int lo = 0, hi = slot->nindex;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (slot->index[mid].rx <= rx) lo = mid + 1;
+      else hi = mid;
+    }
+    int cx = rx;
+    if (lo > 0) {
+      renderchar *e = &slot->index[lo - 1];
+      cx = e->cx + e->len + (rx - e->rx);
+    }
+    int next = lo < slot->nindex ? slot->index[lo].cx : row->size;
+    return cx < next ? cx : next;
+  }
+
+  int cur_rx = 0;
+  int cx = 0;
+  while (cx < row->size) {
+    int tab = editorRowFindTab(row, cx, row->size);
+    if (cur_rx + (tab - cx) > rx) return cx + (rx - cur_rx);  // rx is inside the run of plain chars
+    cur_rx += tab - cx;
+    cx = tab;
+    if (cx == row->size) break;
+
+    cur_rx += EDITOR_TAB_STOP - (cur_rx % EDITOR_TAB_STOP);
+    if (cur_rx > rx) return cx;
+    cx++;
+  }
+  return cx;
+}
+
+void editorUpdateRow(erow *row) {
+  // Fills up the render array of the row's cache slot with characters
+  uint64_t start = statNow();
+  renderslot *slot = renderCacheGet(row);
+  int need = row->size + row->tabs * (EDITOR_TAB_STOP - 1) + 1;
+  if (need > slot->rcap) {
+    textFree(slot->render, slot->rcap);
+    slot->render = textAlloc(need, &slot->rcap);
+  }
+
+  renderSlotReserveIndex(slot, row->tabs);
+  slot->nindex = 0;
+
+  char *render = slot->render;
+  int idx = 0; // Number of characters in render
+  int col = 0;  // Columns they take, fewer than idx once there are multibyte chars
+  int j;
+  for (j = 0; j < row->size; j++){
+    char c = ROW_CHAR(row, j);
+    if (c == '\t') {
+      int from = col;
+      do {  // Add spaces until tab stop (column divisible by 8)
+        render[idx++] = ' ';
+        col++;
+      } while (col % EDITOR_TAB_STOP != 0);
+      renderSlotAddIndex(slot, j, 1, col, idx, col - from);
+    } else if (!(c & 0x80)) {
+      render[idx++] = c;
+      col++;
+    } else {
+      int cp;
+      int len = editorRowDecode(row, j, &cp);
+      if (cp < 0) {  // Not UTF-8
+        render[idx++] = '?';
+        col++;
+        continue;
+      }
+      int width = editorCharWidth(cp);
+      int k;
+      for (k = 0; k < len; k++) render[idx++] = ROW_CHAR(row, j + k);
+      col += width;
+      renderSlotAddIndex(slot, j, len, col, idx, width);
+      j += len - 1;
+    }
+  }
+  render[idx] = '\0';
+  slot->rsize = idx;
+  slot->hlstart = -1;
+  statAdd(STAT_UPDATEROW, start);
+}
+
+void editorUpdateRowAt(erow *row, int at, int added, int rx, int oldend) {
+  // Patches the render after chars starting at at were replaced by added new chars.
+  // rx is the render column of at, and oldend is where the replaced chars used to end.
+  // Only the new chars and the next tab (which absorbs the shift) are expanded again,
+  // everything else is moved over as is.
+  renderslot *slot = renderCacheGet(row);
+  if (slot) slot->hlstart = -1;  // Colors are redone from scratch when the row is drawn
+  if (slot == NULL || slot->rsize < 0) return;  // Nothing cached, editorRowRender() will build it from scratch
+  if (row->tabs < 0 || row->utf8) {
+    // Can't tell which tabs the edit took out of the index, or the edit changes how many bytes
+    // the chars after it take in the render. Start over in both cases
+    slot->rsize = -1;
+    return;
+  }
+  uint64_t start = statNow();
+
+  int j;
+  int newend = rx;
+  int newtabs = 0;
+  for (j = at; j < at + added; j++) {
+    if (ROW_CHAR(row, j) == '\t') {
+      newend += EDITOR_TAB_STOP - (newend % EDITOR_TAB_STOP);
+      newtabs++;
+    }
+    else newend++;
+  }
+
+  int tab = editorRowFindTab(row, at + added, row->size);
+  int plain = tab - (at + added);  // Chars between the edit and the next tab, they only shift
+  int oldtail = oldend + plain;  // Where the unchanged rest of the render starts, before and after
+  int newtail = newend + plain;
+  if (tab < row->size) {
+    oldtail = (oldtail / EDITOR_TAB_STOP + 1) * EDITOR_TAB_STOP;
+    newtail = (newtail / EDITOR_TAB_STOP + 1) * EDITOR_TAB_STOP;
+  }
+
+  int delta = newtail - oldtail;
+  if (delta > 0) {  // Growing, so move the rightmost part first
+    if (slot->rsize + delta + 1 > slot->rcap)
+      slot->render = textRealloc(slot->render, slot->rcap, slot->rsize + delta + 1, &slot->rcap);
+    memmove(&slot->render[newtail], &slot->render[oldtail], slot->rsize - oldtail + 1);
+    memmove(&slot->render[newend], &slot->render[oldend], plain);
+  } else {
+    memmove(&slot->render[newend], &slot->render[oldend], plain);
+    memmove(&slot->render[newtail], &slot->render[oldtail], slot->rsize - oldtail + 1);
+  }
+  slot->rsize += delta;
+
+  // The tabs before the edit keep their place in the index. The tabs after it are the last ones
+  // of the old index, they move over by as much as the first of them did. The edit's own tabs
+  // go in between, replacing whatever tabs were in the replaced chars
+  int before = renderSlotIndexBefore(slot, at);
+  int after = row->tabs - before - newtabs;
+  int first = slot->nindex - after;  // Where the tabs after the edit used to be
+  renderSlotReserveIndex(slot, row->tabs);
+  if (after > 0) {
+    int shift = tab - slot->index[first].cx;
+    memmove(&slot->index[before + newtabs], &slot->index[first], sizeof(renderchar) * after);
+    for (j = before + newtabs; j < row->tabs; j++) {
+      slot->index[j].cx += shift;
+      slot->index[j].rx += delta;
+      slot->index[j].rb += delta;
+    }
+    slot->index[before + newtabs].width = newtail - (newend + plain);
+  }
+  slot->nindex = row->tabs;
+
+  int idx = rx;
+  int t = before;
+  for (j = at; j < at + added; j++) {
+    char c = ROW_CHAR(row, j);
+    if (c == '\t') {
+      int from = idx;
+      slot->render[idx++] = ' ';
+      while(idx % EDITOR_TAB_STOP != 0) slot->render[idx++] = ' ';
+      slot->index[t].cx = j;
+      slot->index[t].len = 1;
+      slot->index[t].width = idx - from;
+      slot->index[t].rx = slot->index[t].rb = idx;
+      t++;
+    } else {
+      slot->render[idx++] = c;
+    }
+  }
+  for (idx = newend + plain; idx < newtail; idx++) slot->render[idx] = ' ';  // The tab after the edit
+  statAdd(STAT_UPDATEROW, start);
+}
+
+void editorRowMaterialize(erow *row) {  // Copies a mapped row onto the heap so it can be edited
+  if (!(row->flags & ROW_MAPPED)) return;
+  char *chars = textAlloc(row->size + 16, &row->cap);  // Leave a small gap for the edit that's coming
+  memcpy(chars, row->chars, row->size);
+  row->chars = chars;
+  row->gap = row->size;
+  row->flags &= ~ROW_MAPPED;
+}
+
+void editorRowMoveGap(erow *row, int at) {  // Moves the gap of an edited row so it starts at at
+  editorRowUnpin(row);  // Everything that writes to a row moves its gap first
+  int gaplen = row->cap - row->size;
+  if (at < row->gap)
+    memmove(&row->chars[at + gaplen], &row->chars[at], row->gap - at);
+  else if (at > row->gap)
+    memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen], at - row->gap);
+  row->gap = at;
+}
+
+void editorRowGrow(erow *row, int need) {  // Makes the gap at least need bytes long
+  editorRowUnpin(row);
+  int gaplen = row->cap - row->size;
+  if (gaplen >= need) return;
+
+  int cap = row->cap * 2;  // Doubling keeps repeated inserts amortized O(1)
+  if (cap < row->size + need) cap = row->size + need;
+  row->chars = textRealloc(row->chars, row->cap, cap, &cap);
+  memmove(&row->chars[row->gap + cap - row->size], &row->chars[row->gap + gaplen], row->size - row->gap);  // Text after the gap goes to the new end
+  row->cap = cap;
+}
+
+char *editorRowTail(erow *row, int at) {  // Returns the text from at to the end of the row as one contiguous run
+  if (row->flags & ROW_MAPPED) return &row->chars[at];
+  if (at < row->gap) editorRowMoveGap(row, at);
+  return &row->chars[at + row->cap - row->size];
+}
+
+char *editorRowChars(erow *row) {  // Returns the whole row as one contiguous run
+  if (!(row->flags & ROW_MAPPED) && row->gap != row->size) editorRowMoveGap(row, row->size);
+  return row->chars;
+}
+
+char *editorRowRender(erow *row, int *rsize) {  // Returns the row as it's drawn, rendering it if needed
+  if (row->tabs < 0) editorRowScan(row);
+  if (row->tabs == 0 && !row->utf8) {  // Nothing to expand, so the text is its own render
+    if (E.syntax == NULL) renderCacheRelease(row);  // Otherwise the slot still holds the row's colors
+    *rsize = row->size;
+    return editorRowChars(row);
+  }
+
+  renderslot *slot = renderCacheGet(row);
+  if (slot == NULL) {
+    slot = renderCacheTake(row);
+    RC.misses++;
+  } else {
+    RC.hits++;
+  }
+  if (slot->rsize < 0) editorUpdateRow(row);
+  renderCacheTouch(row->rslot);
+  *rsize = slot->rsize;
+  return slot->render;
+}
+
+char *editorRowRenderAt(erow *row, int rx, int *len) {
+  // Returns the render starting at column rx, and cuts *len down to the columns it has.
+  // Unlike editorRowRender() this doesn't close the gap of a row without tabs. Only for rows
+  // without utf8 set, whose render bytes and columns are the same thing
+  if (row->tabs < 0) editorRowScan(row);
+  if (row->tabs > 0) {
+    int rsize;
+    char *render = editorRowRender(row, &rsize);
+    if (rx > rsize) rx = rsize;
+    if (*len > rsize - rx) *len = rsize - rx;
+    return &render[rx];
+  }
+
+  if (E.syntax == NULL) renderCacheRelease(row);
+  if (rx > row->size) rx = row->size;
+  if (*len > row->size - rx) *len = row->size - rx;
+  int gaplen = row->cap - row->size;
+  if (rx + *len <= row->gap) return &row->chars[rx];
+  if (rx >= row->gap) return &row->chars[rx + gaplen];
+
+  if (*len > RC.scratchcap) {  // The slice straddles the gap, so put it back together
+    RC.scratch = xrealloc(RC.scratch, *len);
+    RC.scratchcap = *len;
+  }
+  memcpy(RC.scratch, &row->chars[rx], row->gap - rx);
+  memcpy(&RC.scratch[row->gap - rx], &row->chars[row->gap + gaplen], rx + *len - row->gap);
+  return RC.scratch;
+}
+
+int editorRowEditRx(erow *row, int at) {
+  // Render column of at, for editorUpdateRowAt() to patch the render from. Rows with multibyte
+  // chars are rendered again after an edit anyway, so they don't need one
+  return editorRowIsUtf8(row) ? 0 : editorRowCxToRx(row, at);
+}
+
+int editorRowNextChar(erow *row, int cx) {  // Returns where the char after the one at cx starts, skipping the marks that combine with it
+  if (!editorRowIsUtf8(row)) return cx + 1;
+  int cp, len;
+  cx += editorRowDecode(row, cx, &cp);
+  while (cx < row->size && (len = editorRowDecode(row, cx, &cp)) > 1 && editorCharWidth(cp) == 0) cx += len;
+  return cx;
+}
+
+int editorRowPrevChar(erow *row, int cx) {  // Returns where the char before cx starts, marks included
+  if (!editorRowIsUtf8(row)) return cx - 1;
+  int cp;
+  do {
+    int start = cx - 1;
+    while (start > 0 && cx - start < 4 && (ROW_CHAR(row, start) & 0xC0) == 0x80) start--;  // Back over continuation bytes
+    if (editorRowDecode(row, start, &cp) != cx - start) {  // They don't belong to a char ending at cx, so cx - 1 is a stray byte
+      start = cx - 1;
+      cp = -1;
+    }
+    cx = start;
+  } while (cx > 0 && cp >= 0x300 && editorCharWidth(cp) == 0);
+  return cx;
+}
+
+int editorRowCharStart(erow *row, int cx) {  // Moves cx back to the start of the char it's inside of
+  if (!editorRowIsUtf8(row)) return cx;
+  int start = cx, cp;
+  while (start > 0 && start < row->size && cx - start < 3 && (ROW_CHAR(row, start) & 0xC0) == 0x80) start--;
+  return start < cx && start + editorRowDecode(row, start, &cp) > cx ? start : cx;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+
+  editorJournal(JOURNAL_INSERT_ROW, at, 0, s, len);
+  erow row;
+  row.size = len;
+  row.chars = textAlloc(len, &row.cap);
+  row.gap = len;
+  memcpy(row.chars, s, len);
+
+  row.tabs = -1;  // Counted when the row is first drawn
+  row.rslot = -1;
+  row.rgen = 0;
+  row.hlstate = -1;  // Not a state, so editorSyntaxUpdate() can't take it for unchanged
+  row.flags = 0;
+  row.utf8 = 0;
+
+  E.rows = rowTreeInsert(E.rows, at, &row);
+  E.rowcache = NULL;
+  if (at < E.hlvalid) E.hlvalid++;
+
+  E.numrows++;
+  E.dirty++;
+  editorSyntaxUpdate(at);
+}
+
+void editorFreeRow(erow *row) {
+  renderCacheRelease(row);
+  editorRowFreeChars(row);
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  editorJournal(JOURNAL_DEL_ROW, at, 0, NULL, 0);
+  editorFreeRow(editorRowAt(at));
+  E.rows = rowTreeDelete(E.rows, at);
+  E.rowcache = NULL;
+  if (at < E.hlvalid) E.hlvalid--;
+  E.numrows--;
+  E.dirty++;
+  editorSyntaxUpdate(at);  // The next row now follows a different one
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowMaterialize(row);
+  editorRowGrow(row, 1);
+  editorRowMoveGap(row, at);
+  int rx = editorRowEditRx(row, at);
+  row->chars[row->gap++] = c;
+  row->size++;
+  if (c == '\t' && row->tabs >= 0) row->tabs++;
+  if (c & 0x80) row->utf8 = 1;
+  editorUpdateRowAt(row, at, 1, rx, rx);
+  E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, int len) {  // Inserts len chars at at
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowMaterialize(row);
+  editorRowGrow(row, len);
+  editorRowMoveGap(row, at);
+  int rx = editorRowEditRx(row, at);
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->size += len;
+  if (row->tabs >= 0) {
+    row->tabs += editorRowCountTabs(row, at, at + len);
+    if (!editorIsAscii(s, len)) row->utf8 = 1;
+  }
+  editorUpdateRowAt(row, at, len, rx, rx);
+  E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowInsertString(row, row->size, s, len);
+}
+
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowMaterialize(row);
+  int rx = editorRowEditRx(row, at);
+  int oldend = rx + 1;
+  if (ROW_CHAR(row, at) == '\t') {
+    oldend = rx + EDITOR_TAB_STOP - (rx % EDITOR_TAB_STOP);
+    if (row->tabs >= 0) row->tabs--;
+  }
+  editorRowMoveGap(row, at + 1);
+  row->gap--;  // The deleted char becomes part of the gap
+  row->size--;
+  editorUpdateRowAt(row, at, 0, rx, oldend);
+  E.dirty++;
+}
+
+void editorRowDelString(erow *row, int at, int len) {  // Deletes the len chars starting at at
+  if (at < 0 || len <= 0 || at + len > row->size) return;
+  editorRowMaterialize(row);
+  int rx = editorRowEditRx(row, at);
+  int oldend = editorRowEditRx(row, at + len);
+  if (row->tabs > 0) row->tabs -= editorRowCountTabs(row, at, at + len);
+  editorRowMoveGap(row, at + len);
+  row->gap -= len;  // The deleted chars become part of the gap
+  row->size -= len;
+  editorUpdateRowAt(row, at, 0, rx, oldend);
+  E.dirty++;
+}
+
+void editorRowTruncate(erow *row, int len) {  // Cuts the row short at len
+  if (row->tabs > 0) row->tabs -= editorRowCountTabs(row, len, row->size);
+  if (row->flags & ROW_MAPPED) {  // A mapped row can be cut short without copying it
+    row->cap = len;
+    row->gap = len;
+  } else {
+    editorRowMoveGap(row, len);
+  }
+  row->size = len;
+
+  renderslot *slot = renderCacheGet(row);
+  if (slot) slot->hlstart = -1;
+  if (slot && row->utf8) slot->rsize = -1;  // Rendered again from scratch, like any edit of such a row
+  if (slot && slot->rsize >= 0) {
+    slot->rsize = editorRowCxToRx(row, len);
+    slot->render[slot->rsize] = '\0';
+    slot->nindex = renderSlotIndexBefore(slot, len);
+  }
+}
+
+int editorRowReplace(erow *row, const char *q, int qlen, const char *with, int wlen) {
+  // Replaces every copy of q in row with with, left to right, and returns how many there were.
+  // The new text is built in a single allocation and the render is redone once, when drawn
+  char *s = editorRowChars(row);
+  char *end = s + row->size;
+  char *p = s;
+  int n = 0;
+  while ((p = editorMemSearch(p, end - p, q, qlen)) != NULL) {
+    n++;
+    p += qlen;
+  }
+  if (n == 0) return 0;
+
+  int size = row->size + n * (wlen - qlen);
+  int cap;
+  char *chars = textAlloc(size, &cap);
+  char *out = chars;
+  char *m;
+  p = s;
+  while ((m = editorMemSearch(p, end - p, q, qlen)) != NULL) {
+    memcpy(out, p, m - p);
+    out += m - p;
+    memcpy(out, with, wlen);
+    out += wlen;
+    p = m + qlen;
+  }
+  memcpy(out, p, end - p);
+
+  editorRowFreeChars(row);
+  row->chars = chars;
+  row->cap = cap;
+  row->size = row->gap = size;
+  row->flags &= ~(ROW_MAPPED | ROW_PINNED);
+  row->tabs = -1;  // Counted again when the row is drawn
+  renderCacheRelease(row);
+  E.dirty++;
+  return n;
+}
+
+void editorSplitRow(int at, int col) {  // Splits row at in two at col
+  if (col == 0) {  // Same as a new empty row before it, without moving its text
+    editorInsertRow(at, "", 0);
+    return;
+  }
+  erow *row = editorRowAt(at);
+  editorInsertRow(at + 1, editorRowTail(row, col), row->size - col);
+  row = editorRowAt(at);  // Look the row up again because editorInsertRow may have moved it to another chunk
+  editorJournal(JOURNAL_TRUNCATE, at, col, NULL, 0);
+  editorRowTruncate(row, col);
+  rowTreeResized(E.rows, at);
+  editorSyntaxUpdate(at);
+}
+
+void editorJoinRows(int at) {  // Joins row at and the row after it
+  erow *row = editorRowAt(at);
+  if (row->size == 0) {  // Nothing to move, just drop the row
+    editorDelRow(at);
+    return;
+  }
+  erow *next = editorRowAt(at + 1);
+  editorJournal(JOURNAL_APPEND, at, 0, editorRowChars(next), next->size);
+  editorRowAppendString(row, editorRowChars(next), next->size);
+  rowTreeResized(E.rows, at);
+  editorDelRow(at + 1);
+  editorSyntaxUpdate(at);
+}
+
+void editorRowInsertAt(int at, int col, const char *s, int len) {  // Inserts text into row at and journals it
+  editorJournal(JOURNAL_INSERT, at, col, s, len);
+  editorRowInsertString(editorRowAt(at), col, s, len);
+  rowTreeResized(E.rows, at);
+  editorSyntaxUpdate(at);
+}
+
+void editorRowDeleteAt(int at, int col, const char *s, int len) {  // Deletes the copy of text at col from row at
+  editorJournal(JOURNAL_DELETE, at, col, s, len);
+  editorRowDelString(editorRowAt(at), col, len);
+  rowTreeResized(E.rows, at);
+  editorSyntaxUpdate(at);
+}
+
+/* syntax highlighting */
+
+// Only comments that span rows carry state from one row to the next. Every row remembers the
+// state it ends in, so a row can be colored knowing only the row before it. Those states are
+// worked out lazily from the top of the file up to E.hlvalid, and after an edit they are
+// redone going down only for as long as they keep coming out different.
+
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+int editorSyntaxScan(const char *s, int len, int state, unsigned char *hl) {
+  // Colors len chars of s, starting in state, and returns the state at the end. With hl NULL
+  // it only follows comments and strings, since nothing else affects the state
+  struct editorSyntax *syn = E.syntax;
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  if (hl) memset(hl, HL_NORMAL, len);
+  int prev_sep = 1;  // Whether the last char was a separator
+  int in_string = 0;  // Quote that opened the string we're in
+  int in_comment = (state == HL_STATE_COMMENT);
+
+  int i = 0;
+  while (i < len) {
+    char c = s[i];
+    int prev_hl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
+
+    if (in_comment) {
+      if (len - i >= mce_len && !memcmp(&s[i], mce, mce_len)) {
+        if (hl) memset(&hl[i], HL_MLCOMMENT, mce_len);
+        i += mce_len;
+        in_comment = 0;
+        prev_sep = 1;
+      } else {  // Skip to the next char that could start the end of the comment
+        char *next = memchr(&s[i + 1], mce[0], len - i - 1);
+        int end = next ? next - s : len;
+        if (hl) memset(&hl[i], HL_MLCOMMENT, end - i);
+        i = end;
+      }
+      continue;
+    }
+
+    if (in_string) {
+      if (hl) hl[i] = HL_STRING;
+      if (c == '\\' && i + 1 < len) {  // Escaped char, can't end the string
+        if (hl) hl[i + 1] = HL_STRING;
+        i += 2;
+        continue;
+      }
+      if (c == in_string) in_string = 0;
+      i++;
+      prev_sep = 1;
+      continue;
+    }
+
+    if (scs_len && len - i >= scs_len && !memcmp(&s[i], scs, scs_len)) {  // Rest of the row is a comment
+      if (hl) memset(&hl[i], HL_COMMENT, len - i);
+      break;
+    }
+
+    if (mcs_len && mce_len && len - i >= mcs_len && !memcmp(&s[i], mcs, mcs_len)) {
+      if (hl) memset(&hl[i], HL_MLCOMMENT, mcs_len);
+      i += mcs_len;
+      in_comment = 1;
+      continue;
+    }
+
+    if ((syn->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+      in_string = c;
+      if (hl) hl[i] = HL_STRING;
+      i++;
+      continue;
+    }
+
+    if (hl == NULL) {
+      i++;
+      continue;
+    }
+
+    if ((syn->flags & HL_HIGHLIGHT_NUMBERS) &&
+        ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER))) {
+      hl[i] = HL_NUMBER;
+      i++;
+      prev_sep = 0;
+      continue;
+    }
+
+    if (prev_sep && !is_separator((unsigned char)c)) {  // Start of a word, see if the whole word is a keyword
+      int end = i;
+      while (end < len && !is_separator((unsigned char)s[end])) end++;
+      int j;
+      for (j = 0; syn->keywords[j]; j++) {
+        int klen = strlen(syn->keywords[j]);
+        int kw2 = syn->keywords[j][klen - 1] == '|';
+        if (kw2) klen--;
+        if (klen == end - i && !memcmp(&s[i], syn->keywords[j], klen)) {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          break;
+        }
+      }
+      if (syn->keywords[j]) {  // Keywords have no quotes or comments in them, so skipping it is safe
+        i = end;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    prev_sep = is_separator((unsigned char)c);
+    i++;
+  }
+
+  return in_comment ? HL_STATE_COMMENT : HL_STATE_NORMAL;
+}
+
+int editorSyntaxRowState(erow *row, int start) {  // Returns the state row ends in if it starts in start
+  if (row->size > HL_MAX_ROW) return start;
+  return editorSyntaxScan(editorRowChars(row), row->size, start, NULL);
+}
+
+int editorSyntaxStateBefore(int at) {  // Returns the state row at starts in, working it out if needed
+  int state = E.hlvalid > 0 ? editorRowAt(E.hlvalid - 1)->hlstate : HL_STATE_NORMAL;
+  while (E.hlvalid < at) {
+    erow *row = editorRowAt(E.hlvalid);
+    state = row->hlstate = editorSyntaxRowState(row, state);
+    E.hlvalid++;
+  }
+  return at > 0 ? editorRowAt(at - 1)->hlstate : HL_STATE_NORMAL;
+}
+
+void editorSyntaxUpdate(int at) {
+  // Row at has changed, or has a different row before it now. Works out its state again, and
+  // keeps going down while the states change. Rows below the screen are left for later
+  if (E.syntax == NULL || at >= E.hlvalid) return;  // Not worked out yet anyway
+
+  int state = at > 0 ? editorRowAt(at - 1)->hlstate : HL_STATE_NORMAL;
+  int bottom = E.rowoff + E.screenrows;
+  while (at < E.hlvalid) {
+    if (at > bottom) {
+      E.hlvalid = at;
+      return;
+    }
+    erow *row = editorRowAt(at);
+    int end = editorSyntaxRowState(row, state);
+    if (end == row->hlstate) return;  // Everything after this row starts the same way it did
+    row->hlstate = state = end;
+    at++;
+  }
+}
+
+unsigned char *editorRowHighlight(int at, erow *row, const char *render, int rsize) {
+  // Returns the colors of the row's render, only scanning it again if its text or the state
+  // it starts in changed since the last time
+  int start = editorSyntaxStateBefore(at);
+  renderslot *slot = renderCacheGet(row);
+  if (slot == NULL) slot = renderCacheTake(row);
+
+  if (slot->hlstart != start) {
+    if (slot->hl == NULL || rsize > slot->hlcap) {
+      textFree((char *)slot->hl, slot->hlcap);
+      slot->hl = (unsigned char *)textAlloc(rsize, &slot->hlcap);
+    }
+    editorSyntaxScan(render, rsize, start, slot->hl);
+    slot->hlstart = start;
+  }
+  renderCacheTouch(row->rslot);
+  return slot->hl;
+}
+
+void editorSyntaxReset() {  // Forgets every state and color, for when the rules change
+  int i;
+  E.hlvalid = 0;
+  for (i = 0; i < RENDER_CACHE_SLOTS; i++) RC.slots[i].hlstart = -1;
+}
+
+void editorSelectSyntaxHighlight() {  // Picks the rules matching the file name
+  E.syntax = NULL;
+  editorSyntaxReset();
+  if (E.filename == NULL) return;
+
+  char *ext = strrchr(E.filename, '.');
+  unsigned int j;
+  for (j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    int i;
+    for (i = 0; s->filematch[i]; i++) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        E.syntax = s;
+        return;
+      }
+    }
+  }
+}
+
+/* undo */
+
+// Edits are logged as ops that can be undone and redone. Typing into a row extends the last
+// op instead of adding one per char, and deleted text is kept once in an arena that every
+// op points into, so a long paste is a single op and takes one pass to undo. Ops are undone
+// in groups: a run of typing, or of deleting, with no cursor movement or pause between the
+// keys. When the log outgrows UNDO_MEMORY the oldest groups are dropped.
+
+typedef struct undoop {  // One edit in the undo log
+  unsigned char type;  // undotype
+  unsigned char back;  // An UNDO_DELETE made by backspacing, its text is stored last char first
+  int row, col;
+  int len;  // Bytes of text
+  unsigned int group;
+  size_t text;  // Where its text starts in U.text
+} undoop;
+
+struct undolog {
+  undoop *ops;
+  int first;  // Ops before this one were dropped
+  int n;
+  int cur;  // Ops before cur are done, the ones from cur on were undone and can be redone
+  int cap;
+  char *text;  // Arena holding the text of every op, in op order
+  size_t textfirst;  // Text before this belongs to dropped ops
+  size_t textlen;
+  size_t textcap;
+  unsigned int group;  // Group of the newest op
+  unsigned int dropped;  // A group that got too big to keep, the rest of its ops aren't logged
+  int kind;  // What the newest group is doing, see editorUndoRecord()
+  int broken;  // Set when the cursor moves, so the next edit starts a new group
+  int paused;  // Undoing, redoing or replaying the journal, which isn't logged
+  struct timespec last;  // When the newest op was logged
+};
+
+struct undolog U;
+
+void editorUndoBreak() {  // The next edit starts a new group
+  U.broken = 1;
+}
+
+void editorUndoText(const char *s, int len) {  // Adds text to the end of the arena
+  if (len == 0) return;
+  if (U.textlen + len > U.textcap) {
+    U.textcap = U.textcap ? U.textcap * 2 : 4096;
+    if (U.textcap < U.textlen + len) U.textcap = U.textlen + len;
+    U.text = xrealloc(U.text, U.textcap);
+  }
+  memcpy(&U.text[U.textlen], s, len);
+  U.textlen += len;
+}
+
+void editorUndoTrim() {  // Drops the oldest groups until the log fits in UNDO_MEMORY
+  while (U.n > U.first && (U.n - U.first) * sizeof(undoop) + U.textlen - U.textfirst > UNDO_MEMORY) {
+    unsigned int group = U.ops[U.first].group;
+    if (group == U.group) U.dropped = group;  // The group being logged doesn't fit on its own
+    while (U.first < U.n && U.ops[U.first].group == group) U.first++;
+    if (U.cur < U.first) U.cur = U.first;
+    U.textfirst = U.first < U.n ? U.ops[U.first].text : U.textlen;
+  }
+  if (U.first > U.n / 2) {  // Move what's left down once the dropped part is half the log
+    int i;
+    for (i = U.first; i < U.n; i++) U.ops[i].text -= U.textfirst;
+    memmove(U.ops, &U.ops[U.first], sizeof(undoop) * (U.n - U.first));
+    memmove(U.text, &U.text[U.textfirst], U.textlen - U.textfirst);
+    U.n -= U.first;
+    U.cur -= U.first;
+    U.textlen -= U.textfirst;
+    U.first = 0;
+    U.textfirst = 0;
+  }
+}
+
+void editorUndoForget() {
+  // Empties the log and stops the group being logged, for an edit too big to keep. What came
+  // before it can't be undone either, its ops would land on text that's since changed
+  U.n = U.first = U.cur = 0;
+  U.textlen = U.textfirst = 0;
+  U.dropped = U.group;
+}
+
+void editorUndoRecord(int type, int row, int col, const char *s, int len) {  // Logs an edit that's about to be made
+  if (U.paused) return;
+  if (U.cur < U.n) {  // A new edit can't be redone past
+    U.textlen = U.ops[U.cur].text;
+    U.n = U.cur;
+  }
+
+  int kind = type == UNDO_INSERT || type == UNDO_SPLIT ? 1 : type == UNDO_DELETE || type == UNDO_JOIN ? 2 : 3;
+  int joins = type == UNDO_ROW ||  // Rows changed by a replace belong to it
+    (type != UNDO_REPLACE && !U.broken && kind == U.kind && editorSeconds(&U.last) * 1000 < UNDO_GROUP_MS);
+  if (!joins) {
+    U.group++;
+    U.kind = kind;
+    U.broken = 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &U.last);
+  if (U.group == U.dropped) return;
+
+  undoop *last = joins && U.n > U.first && U.ops[U.n - 1].group == U.group ? &U.ops[U.n - 1] : NULL;
+  if (last && type == UNDO_INSERT && last->type == UNDO_INSERT && last->row == row && last->col + last->len == col) {
+    editorUndoText(s, len);  // Typing on from the last insert
+    last->len += len;
+    editorUndoTrim();
+    return;
+  }
+  if (last && type == UNDO_DELETE && len == 1 && last->type == UNDO_DELETE && last->row == row) {
+    if (col == last->col && !last->back) {  // Deleting forward
+      editorUndoText(s, 1);
+      last->len++;
+      editorUndoTrim();
+      return;
+    }
+    if (col + 1 == last->col && (last->back || last->len == 1)) {  // Backspacing
+      editorUndoText(s, 1);
+      last->back = 1;
+      last->col--;
+      last->len++;
+      editorUndoTrim();
+      return;
+    }
+  }
+
+  if (U.n == U.cap) {
+    U.cap = U.cap ? U.cap * 2 : 256;
+    U.ops = xrealloc(U.ops, sizeof(undoop) * U.cap);
+  }
+  undoop *op = &U.ops[U.n++];
+  op->type = type;
+  op->back = 0;
+  op->row = row;
+  op->col = col;
+  op->len = len;
+  op->group = U.group;
+  op->text = U.textlen;
+  editorUndoText(s, len);
+  U.cur = U.n;
+  editorUndoTrim();
+}
+
+void editorUndoApply(undoop *op, int redo) {  // Undoes or redoes an op and puts the cursor where it happened
+  char *s = &U.text[op->text];
+  char *rev = NULL;
+  if (op->back) {  // Put a backspaced run back in order
+    rev = xmalloc(op->len);
+    int i;
+    for (i = 0; i < op->len; i++) rev[i] = s[op->len - 1 - i];
+    s = rev;
+  }
+
+  if (op->type != UNDO_REPLACE) {  // A replace leaves the cursor on the first row it changed
+    E.cy = op->row;
+    E.cx = op->col;
+  }
+  switch (op->type) {
+    case UNDO_INSERT:
+      if (redo) {
+        editorRowInsertAt(op->row, op->col, s, op->len);
+        E.cx += op->len;
+      } else {
+        editorRowDeleteAt(op->row, op->col, s, op->len);
+      }
+      break;
+    case UNDO_DELETE:
+      if (redo) {
+        editorRowDeleteAt(op->row, op->col, s, op->len);
+      } else {
+        editorRowInsertAt(op->row, op->col, s, op->len);
+        if (op->back) E.cx += op->len;
+      }
+      break;
+    case UNDO_SPLIT:
+      if (redo) {
+        editorSplitRow(op->row, op->col);
+        E.cy++;
+        E.cx = 0;
+      } else {
+        editorJoinRows(op->row);
+      }
+      break;
+    case UNDO_JOIN:
+      if (redo) {
+        editorJoinRows(op->row);
+      } else {
+        editorSplitRow(op->row, op->col);
+        E.cy++;
+        E.cx = 0;
+      }
+      break;
+    case UNDO_ROW:  // Redone by the UNDO_REPLACE before it
+      if (!redo) {
+        erow *row = editorRowAt(op->row);
+        editorJournal(JOURNAL_TRUNCATE, op->row, 0, NULL, 0);
+        editorRowTruncate(row, 0);
+        editorJournal(JOURNAL_APPEND, op->row, 0, s, op->len);
+        editorRowAppendString(row, s, op->len);
+        rowTreeResized(E.rows, op->row);
+        editorSyntaxUpdate(op->row);
+        E.cx = 0;
+      }
+      break;
+    case UNDO_REPLACE:  // The text is the query (col bytes) and then its replacement
+      if (redo) {
+        char *q = xstrndup(s, op->col);
+        char *with = xstrndup(&s[op->col], op->len - op->col);
+        editorReplaceAll(q, with);
+        xfree(q);
+        xfree(with);
+      }
+      break;
+  }
+  xfree(rev);
+}
+
+void editorUndo() {  // Undoes the newest group of edits that's done
+  if (U.cur == U.first) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  unsigned int group = U.ops[U.cur - 1].group;
+  U.paused = 1;
+  while (U.cur > U.first && U.ops[U.cur - 1].group == group) {
+    U.cur--;
+    editorUndoApply(&U.ops[U.cur], 0);
+  }
+  U.paused = 0;
+  U.broken = 1;
+}
+
+void editorRedo() {  // Redoes the oldest group of edits that was undone
+  if (U.cur == U.n) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  unsigned int group = U.ops[U.cur].group;
+  U.paused = 1;
+  while (U.cur < U.n && U.ops[U.cur].group == group) {
+    editorUndoApply(&U.ops[U.cur], 1);
+    U.cur++;
+  }
+  U.paused = 0;
+  U.broken = 1;
+}
+
+/* editor operations */
+
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {  // If cursor is on a new line then insert a row
+    editorUndoRecord(UNDO_SPLIT, E.numrows, 0, NULL, 0);
+    editorInsertRow(E.numrows, "", 0);
+  }
+  char ch = c;
+  editorUndoRecord(UNDO_INSERT, E.cy, E.cx, &ch, 1);
+  editorJournal(JOURNAL_INSERT_CHAR, E.cy, E.cx, &ch, 1);
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);  // Add the character
+  rowTreeResized(E.rows, E.cy);
+  editorSyntaxUpdate(E.cy);
+  E.cx++;
+}
+
+const char *editorLineBreak(const char *s, const char *end) {  // Returns the first \r or \n in [s, end), or end
+  while (s < end && *s != '\r' && *s != '\n') s++;
+  return s;
+}
+
+void editorInsertText(const char *s, int len) {
+  // Inserts pasted text at the cursor. The cursor's row is split once and the pasted lines go in
+  // between its halves as whole rows, instead of splitting the row again at every line break
+  if (len == 0) return;
+  editorUndoBreak();  // A paste is an undo step of its own
+  if (E.cy == E.numrows) {
+    editorUndoRecord(UNDO_SPLIT, E.numrows, 0, NULL, 0);
+    editorInsertRow(E.numrows, "", 0);
+  }
+
+  const char *end = s + len;
+  const char *eol = editorLineBreak(s, end);
+  if (eol < end) {
+    editorUndoRecord(UNDO_SPLIT, E.cy, E.cx, NULL, 0);
+    editorSplitRow(E.cy, E.cx);
+  }
+  if (eol > s) {
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx, s, eol - s);
+    editorRowInsertAt(E.cy, E.cx, s, eol - s);
+  }
+  E.cx += eol - s;
+
+  while (eol < end) {
+    s = eol + (eol[0] == '\r' && eol + 1 < end && eol[1] == '\n' ? 2 : 1);  // Terminals send line breaks as \r
+    eol = editorLineBreak(s, end);
+    E.cy++;
+    if (eol < end) {  // A whole line becomes a new row
+      editorUndoRecord(UNDO_SPLIT, E.cy, 0, NULL, 0);
+      if (eol > s) editorUndoRecord(UNDO_INSERT, E.cy, 0, s, eol - s);
+      editorInsertRow(E.cy, (char *)s, eol - s);
+    } else if (eol > s) {  // The last line goes in front of the second half of the row
+      editorUndoRecord(UNDO_INSERT, E.cy, 0, s, eol - s);
+      editorRowInsertAt(E.cy, 0, s, eol - s);
+    }
+    E.cx = eol - s;
+  }
+  editorUndoBreak();
+}
+
+void editorInsertNewline() {
+  editorUndoRecord(UNDO_SPLIT, E.cy, E.cx, NULL, 0);
+  editorSplitRow(E.cy, E.cx);
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar() {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0) {
+    int from = editorRowPrevChar(row, E.cx);
+    int i;
+    for (i = E.cx - 1; i >= from; i--) {  // Byte by byte, so backspacing over multibyte chars still merges into one undo step
+      char ch = ROW_CHAR(row, i);
+      editorUndoRecord(UNDO_DELETE, E.cy, i, &ch, 1);
+    }
+    if (E.cx - from == 1) {
+      editorJournal(JOURNAL_DEL_CHAR, E.cy, from, NULL, 0);
+      editorRowDelChar(row, from);
+      rowTreeResized(E.rows, E.cy);
+      editorSyntaxUpdate(E.cy);
+    } else {
+      editorRowDeleteAt(E.cy, from, editorRowTail(row, from), E.cx - from);
+    }
+    E.cx = from;
+  } else {
+    E.cx = editorRowAt(E.cy - 1)->size;
+    editorUndoRecord(UNDO_JOIN, E.cy - 1, E.cx, NULL, 0);
+    editorJoinRows(E.cy - 1);
+    E.cy--;
+  }
+}
+
+/* file i/o */
+
+char *editorPathf(const char *fmt, ...) {
+  // Builds a file name from fmt, sized to fit. Every temporary and journal name is made here.
+  // Returns NULL with errno set if it can't be
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  char *path = len < 0 ? NULL : xmalloc(len + 1);
+  if (path == NULL) return NULL;
+  va_start(ap, fmt);
+  vsnprintf(path, len + 1, fmt, ap);
+  va_end(ap);
+  return path;
+}
+
+int editorMapRows(char *map, size_t len) {  // Splits a mapping into row views, returns the number of rows
+  // Only called on an empty buffer, so the chunks can be filled up in order and appended to the tree
+  int numrows = 0;
+  rowchunk *c = NULL;
+  char *p = map, *end = map + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    while (eol > p && eol[-1] == '\r') eol--;
+
+    if (c == NULL || c->n == ROWS_CHUNK) {
+      if (c) E.rows = rowTreeInsertBack(E.rows, c);
+      rowchunk *next = rowChunkNew();
+      next->prev = c;
+      if (c) c->next = next;
+      c = next;
+    }
+
+    erow *row = &c->rows[c->n++];
+    numrows++;
+    row->size = eol - p;
+    c->nbytes += row->size + 1;
+    row->chars = p;
+    row->cap = row->size;
+    row->gap = row->size;
+    row->tabs = -1;  // Rendered by editorRowRender() when it scrolls into view
+    row->rslot = -1;
+    row->rgen = 0;
+    row->hlstate = -1;
+    row->flags = ROW_MAPPED;
+    row->utf8 = 0;
+    p = nl ? nl + 1 : end;
+  }
+  if (c) E.rows = rowTreeInsertBack(E.rows, c);
+  E.rowcache = NULL;
+  return numrows;
+}
+
+int editorMapFile(const char *filename) {  // Loads the file as views into a read-only mapping
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {  // Empty files can't be mapped
+    close(fd);
+    return -1;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // The mapping keeps its own reference to the file
+  if (map == MAP_FAILED) return -1;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  if (E.map) munmap(E.map, E.maplen);
+  E.map = map;
+  E.maplen = st.st_size;
+  E.numrows = editorMapRows(map, st.st_size);
+  return 0;
+}
+
+void editorReadFile(char *filename) {  // Loads the file by reading it line by line, for files that can't be mapped
+  FILE *fp = fopen(filename, "r");
+  if (!fp) die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  TA.bulk = 1;  // Rows are packed back to back instead of rounded up to size classes
+  while ((linelen = getline(&line, &linecap, fp)) != -1){
     while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
       linelen--;
 
-    editorInsertRow(E.numrows, line, linelen);
-  }
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  TA.bulk = 0;
+
+  free(line);
+  fclose(fp);
+}
+
+void editorOpen(char *filename) {
+  xfree(E.filename);
+  E.filename = xstrdup(filename);
+  editorSelectSyntaxHighlight();
+
+  if (editorMapFile(filename) == -1) editorReadFile(filename);
+  E.dirty = 0;
+
+  long recovered = editorJournalReplay();
+  if (recovered > 0)
+    editorSetStatusMessage("Recovered %ld edits from the journal | Ctrl-S to keep them", recovered);
+}
+
+void editorRemapAfterSave(const char *filename, size_t len) {
+  // Maps the file we just saved and points every row into it, which lets edited rows drop
+  // their heap copies. If that fails the rows keep the old mapping, it's still there since
+  // the new file replaced the old one by rename instead of overwriting it, or it's the
+  // temporary file's that editorSaveRepoint() moved them to
+  int fd = open(filename, O_RDONLY);
+  char *map = (fd == -1 || len == 0) ? MAP_FAILED : mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd != -1) close(fd);
+  if (map == MAP_FAILED) return;
+
+  size_t off = 0;
+  rowchunk *c = E.rows;
+  while (c && c->left) c = c->left;
+  for (; c; c = c->next) {
+    int j;
+    for (j = 0; j < c->n; j++) {
+      erow *row = &c->rows[j];
+      editorRowFreeChars(row);
+      row->chars = map + off;
+      row->cap = row->size;
+      row->gap = row->size;
+      row->flags = ROW_MAPPED;
+      off += row->size + 1;
+    }
+  }
+
+  if (E.map) munmap(E.map, E.maplen);
+  E.map = map;
+  E.maplen = len;
+}
+
+// Saving runs on a writer thread while editing goes on. Ctrl-S takes a snapshot of the file
+// as a list of pieces pointing straight into the mapping and the row buffers, and the writer
+// streams them out with writev() without building the file in memory. It goes to a temporary
+// file next to the real one, which only replaces it once it's safely on disk, so a failed
+// save leaves the old file as it was. The real one is where a symlink leads, and the temporary
+// file gets its mode, owner and extended attributes. When it can't have them, or the rename
+// would break a hard link or a dangling symlink, it's copied over the real file instead. So is
+// one made in $TMPDIR when the real file's directory won't take it, and if that copy fails
+// the temporary file stays, the status bar says where.
+//
+// The mapping can't change under the writer. Row buffers can, so the snapshot pins them, and
+// a pinned row gets a copy of its text before it's edited. The buffer the writer has is kept
+// until the snapshot is written. A pin outlives its save, it's only honored while one is
+// writing. Before a copy over the real file, whose mapping it would change, the rows still
+// in that mapping are pointed into a mapping of the temporary file instead, which has the
+// same text, and the writer does the copy.
+
+struct saver {
+  pthread_t thread;
+  int running;  // A snapshot is out and its pins hold
+  int again;  // Ctrl-S was pressed during the save, so take another snapshot after it
+  char *filename;
+  char *target;  // The file that's written, filename with its symlinks resolved
+  char *tmp;  // Temporary file the writer fills up
+  int inplace;  // Set when tmp has to be copied over target instead of renamed to it
+  int copying;  // Set once the writer is on to that copy
+  struct iovec *pieces;  // The snapshot, the file in order
+  int npieces;
+  int piececap;
+  size_t total;  // Bytes in the snapshot
+  size_t written;  // Bytes the writer has written so far
+  size_t seen;  // What written was when the main thread last looked
+  int finished;  // Set by the writer when it's done
+  int err;  // errno of what went wrong, 0 if the save worked
+  int dirty;  // E.dirty when the snapshot was taken
+  size_t journal;  // editorJournalMark() when the snapshot was taken
+  char **keep;  // Buffers of pinned rows that were edited or deleted, freed once the save is done
+  int *keepcap;
+  int nkeep;
+  int keepalloc;
+  struct timespec start;
+};
+
+struct saver SV;
+
+void editorSaveKeep(char *chars, int cap) {  // Holds on to a buffer the writer still reads until the save is done
+  if (SV.nkeep == SV.keepalloc) {
+    SV.keepalloc = SV.keepalloc ? SV.keepalloc * 2 : 64;
+    SV.keep = xrealloc(SV.keep, sizeof(char *) * SV.keepalloc);
+    SV.keepcap = xrealloc(SV.keepcap, sizeof(int) * SV.keepalloc);
+  }
+  SV.keep[SV.nkeep] = chars;
+  SV.keepcap[SV.nkeep] = cap;
+  SV.nkeep++;
+}
+
+void editorRowUnpin(erow *row) {  // Copies a pinned row's text so it can change, the writer keeps the old one
+  if (!(row->flags & ROW_PINNED)) return;
+  row->flags &= ~ROW_PINNED;
+  if (!SV.running || SV.copying) return;  // Pinned by a save that's written its snapshot
+
+  editorSaveKeep(row->chars, row->cap);
+  char *chars = textAlloc(row->size, &row->cap);  // The snapshot closed the gap, so it's one memcpy
+  memcpy(chars, row->chars, row->size);
+  row->chars = chars;
+  row->gap = row->size;
+}
+
+void editorRowFreeChars(erow *row) {  // Frees an edited row's text, or leaves it to the save that's writing it
+  if (row->flags & ROW_MAPPED) return;
+  if ((row->flags & ROW_PINNED) && SV.running && !SV.copying) editorSaveKeep(row->chars, row->cap);
+  else textFree(row->chars, row->cap);
+  row->flags &= ~ROW_PINNED;
+}
+
+void editorSaveAdd(char *p, size_t len) {  // Adds len bytes at p to the snapshot
+  if (len == 0) return;
+  SV.total += len;
+  if (SV.npieces > 0) {  // Runs of unedited rows follow on from each other in the mapping and go out as one piece
+    struct iovec *last = &SV.pieces[SV.npieces - 1];
+    if ((char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (SV.npieces == SV.piececap) {
+    SV.piececap = SV.piececap ? SV.piececap * 2 : 1024;
+    SV.pieces = xrealloc(SV.pieces, sizeof(struct iovec) * SV.piececap);
+  }
+  SV.pieces[SV.npieces].iov_base = p;
+  SV.pieces[SV.npieces].iov_len = len;
+  SV.npieces++;
+}
+
+void editorSaveRow(erow *row) {  // Adds a row and its line ending to the snapshot
+  static char newline = '\n';
+  if (row->flags & ROW_MAPPED) {
+    if (row->chars + row->size < E.map + E.maplen && row->chars[row->size] == '\n') {
+      editorSaveAdd(row->chars, row->size + 1);  // The mapping has the line ending right after it
+      return;
+    }
+    editorSaveAdd(row->chars, row->size);
+    editorSaveAdd(&newline, 1);
+    return;
+  }
+
+  editorRowChars(row);  // Close the gap, and put the line ending in it if there's room
+  if (row->cap > row->size) {
+    row->chars[row->size] = '\n';
+    editorSaveAdd(row->chars, row->size + 1);
+  } else {
+    editorSaveAdd(row->chars, row->size);
+    editorSaveAdd(&newline, 1);
+  }
+  row->flags |= ROW_PINNED;
+}
+
+int editorSaveWrite(int fd) {
+  // Writes the snapshot to fd, SAVE_IOVECS pieces at a time. Returns -1 on error. The pieces
+  // are left as they are, editorSaveRepoint() finds the rows in the file by them
+  struct iovec *iov = SV.pieces;
+  int left = SV.npieces;
+  while (left > 0) {
+    int n = left < SAVE_IOVECS ? left : SAVE_IOVECS;
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    __atomic_fetch_add(&SV.written, w, __ATOMIC_RELAXED);
+    while (left > 0 && (size_t)w >= iov->iov_len) {  // Skip what went out, a short write can stop mid piece
+      w -= iov->iov_len;
+      iov++;
+      left--;
+    }
+    if (left > 0 && w > 0) {  // Finish that piece on its own
+      char *p = (char *)iov->iov_base + w;
+      size_t rest = iov->iov_len - w;
+      while (rest > 0) {
+        ssize_t w2 = write(fd, p, rest);
+        if (w2 == -1) {
+          if (errno == EINTR) continue;
+          return -1;
+        }
+        __atomic_fetch_add(&SV.written, w2, __ATOMIC_RELAXED);
+        p += w2;
+        rest -= w2;
+      }
+      iov++;
+      left--;
+    }
+  }
+  return 0;
+}
+
+int editorSaveAttrs(int fd, struct stat *st) {
+  // Gives the temporary file fd the owner and extended attributes of the file it replaces,
+  // which has stat st. Returns -1 if any of them didn't take
+  struct stat tst;
+  if (fstat(fd, &tst) == -1) return -1;
+  if ((st->st_uid != tst.st_uid || st->st_gid != tst.st_gid) && fchown(fd, st->st_uid, st->st_gid) == -1) return -1;
+  if (fchmod(fd, st->st_mode & 07777) == -1) return -1;  // After fchown(), which clears the setuid bits
+
+  ssize_t len = listxattr(SV.target, NULL, 0);  // ACLs and security labels are among them
+  if (len <= 0) return len == -1 && errno != ENOTSUP ? -1 : 0;
+  char *names = xmalloc(len);
+  char *value = NULL;
+  int ret = 0;
+  len = listxattr(SV.target, names, len);
+  char *name;
+  for (name = names; ret == 0 && len > 0 && name < names + len; name += strlen(name) + 1) {
+    ssize_t vlen = getxattr(SV.target, name, NULL, 0);
+    if (vlen == -1) ret = -1;
+    else if ((value = xrealloc(value, vlen + 1)) == NULL) ret = -1;
+    else if ((vlen = getxattr(SV.target, name, value, vlen)) == -1 || fsetxattr(fd, name, value, vlen, 0) == -1) ret = -1;
+  }
+  if (len == -1) ret = -1;  // The list changed between the two calls
+  xfree(names);
+  xfree(value);
+  return ret;
+}
+
+int editorSaveTo(int fd) {  // Writes the snapshot to the temporary file fd and puts it in place, returns -1 on error
+  if (editorSaveWrite(fd) == -1 || fsync(fd) == -1) return -1;
+
+  struct stat st;  // mkstemp() makes the file private, give it the old file's mode instead
+  if (stat(SV.target, &st) == 0) {
+    if (st.st_nlink > 1 || editorSaveAttrs(fd, &st) == -1) SV.inplace = 1;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0644 & ~mask);
+  }
+  if (SV.inplace) return 0;  // Copied over once the rows are off the real file, see editorSaveFinish()
+  if (rename(SV.tmp, SV.target) == -1) return -1;
+
+  char *slash = strrchr(SV.tmp, '/');  // Make the rename itself stick by syncing the directory
+  char *dir = slash ? xstrndup(SV.tmp, slash - SV.tmp + 1) : xstrdup(".");
+  int dfd = open(dir, O_RDONLY);
+  if (dfd != -1) {
+    fsync(dfd);
+    close(dfd);
+  }
+  xfree(dir);
+  return 0;
+}
+
+int editorSaveInPlace() {
+  // Copies the temporary file over the real one, keeping the real one's inode and everything
+  // that comes with it. Runs on the writer thread once editorSaveRepoint() has taken the rows
+  // off the real file. Returns -1 on error, and leaves the temporary file for the user then
+  int in = open(SV.tmp, O_RDONLY);
+  int out = in == -1 ? -1 : open(SV.target, O_WRONLY | O_CREAT, 0666);
+  int ret = in == -1 || out == -1 ? -1 : 0;
+  char buf[65536];
+  ssize_t n;
+  while (ret == 0 && (n = read(in, buf, sizeof(buf))) != 0) {
+    if (n == -1) {
+      if (errno != EINTR) ret = -1;
+      continue;
+    }
+    char *p = buf;
+    while (ret == 0 && n > 0) {
+      ssize_t w = write(out, p, n);
+      if (w == -1 && errno != EINTR) ret = -1;
+      if (w > 0) {
+        __atomic_fetch_add(&SV.written, w, __ATOMIC_RELAXED);
+        p += w;
+        n -= w;
+      }
+    }
+  }
+  if (ret == 0 && (ftruncate(out, SV.total) == -1 || fsync(out) == -1)) ret = -1;
+  int err = errno;
+  if (out != -1 && close(out) == -1 && ret == 0) {
+    ret = -1;
+    err = errno;
+  }
+  if (in != -1) close(in);
+  if (ret == 0) unlink(SV.tmp);  // Otherwise it's the only whole copy of the new text on disk
+  errno = err;
+  return ret;
+}
+
+int editorSaveTemp() {  // Writes the snapshot to a temporary file, returns -1 on error
+  int fd = SV.tmp ? mkstemp(SV.tmp) : (errno = ENOMEM, -1);
+  if (fd == -1 && SV.tmp) {
+    // No temporary file next to the real one, in a directory we can't write to say. One in
+    // $TMPDIR then, copied over the real one as that may still be writable
+    int first = errno;
+    const char *dir = getenv("TMPDIR");
+    const char *slash = strrchr(SV.target, '/');
+    char *tmp = editorPathf("%s/%s.XXXXXX", dir && *dir ? dir : "/tmp", slash ? slash + 1 : SV.target);
+    if (tmp && (fd = mkstemp(tmp)) != -1) {
+      xfree(SV.tmp);
+      SV.tmp = tmp;
+      SV.inplace = 1;
+    } else {
+      xfree(tmp);
+      errno = first;  // Why it couldn't go next to the file is the news
+    }
+  }
+  if (fd == -1) return -1;
+  int err = 0;
+  if (editorSaveTo(fd) == -1) err = errno;
+  if (close(fd) == -1 && err == 0) err = errno;
+  if (err == 0) return 0;
+  unlink(SV.tmp);  // The old file is untouched
+  errno = err;
+  return -1;
+}
+
+void *editorSaveWorker(void *arg) {  // The writer, first for the temporary file and then for a copy of it
+  (void)arg;
+  int ret = SV.copying ? editorSaveInPlace() : editorSaveTemp();
+  SV.err = ret == -1 ? errno : 0;
+  __atomic_store_n(&SV.finished, 1, __ATOMIC_RELEASE);
+  editorWake();
+  return NULL;
+}
+
+void editorSaveSpawn() {  // Starts the writer
+  SV.finished = 0;
+  if (pthread_create(&SV.thread, NULL, editorSaveWorker, NULL) != 0) {  // No thread to be had, so write it right here
+    SV.thread = pthread_self();
+    editorSaveWorker(NULL);
+  }
+}
+
+int editorSaveRepoint() {
+  // Moves the rows still in the mapping of the real file over to the same text in the
+  // temporary file, which is about to be copied over the real one. The snapshot says where
+  // each of them went, rows and pieces are both in file order. Returns 1 if any rows moved
+  if (E.map == NULL) return 0;
+  int fd = open(SV.tmp, O_RDONLY);
+  char *map = (fd == -1 || SV.total == 0) ? MAP_FAILED : mmap(NULL, SV.total, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd != -1) close(fd);
+
+  struct iovec *iov = SV.pieces, *end = SV.pieces + SV.npieces;
+  size_t off = 0;  // Where iov starts in the temporary file
+  rowchunk *c = E.rows;
+  while (c && c->left) c = c->left;
+  for (; c; c = c->next) {
+    int j;
+    for (j = 0; j < c->n; j++) {
+      erow *row = &c->rows[j];
+      if (!(row->flags & ROW_MAPPED)) continue;
+      while (iov < end && ((char *)iov->iov_base < E.map || (char *)iov->iov_base >= E.map + E.maplen ||
+                           (char *)iov->iov_base + iov->iov_len <= row->chars)) {
+        off += iov->iov_len;
+        iov++;
+      }
+      char *base = iov < end ? iov->iov_base : NULL;
+      if (map != MAP_FAILED && base && row->size > 0 && row->chars >= base && row->chars + row->size <= base + iov->iov_len)
+        row->chars = map + off + (row->chars - base);
+      else
+        editorRowMaterialize(row);  // An empty row that isn't in the snapshot, or no mapping to be had
+    }
+  }
+
+  munmap(E.map, E.maplen);
+  E.map = map != MAP_FAILED ? map : NULL;
+  E.maplen = map != MAP_FAILED ? SV.total : 0;
+  return 1;
+}
+
+void editorSaveStart() {  // Takes a snapshot of the rows and hands it to the writer
+  clock_gettime(CLOCK_MONOTONIC, &SV.start);
+  SV.npieces = 0;
+  SV.total = SV.written = SV.seen = 0;
+  SV.again = 0;
+  SV.dirty = E.dirty;
+  SV.journal = editorJournalMark();
+  xfree(SV.filename);
+  free(SV.target);  // From realpath(), or the strdup() standing in for it
+  xfree(SV.tmp);
+  SV.filename = xstrdup(E.filename);
+  SV.target = realpath(E.filename, NULL);
+  struct stat st;
+  SV.inplace = SV.target == NULL && lstat(E.filename, &st) == 0 && S_ISLNK(st.st_mode);  // Dangling, write through it
+  if (SV.target == NULL) SV.target = strdup(E.filename);
+  SV.tmp = editorPathf("%s.XXXXXX", SV.target);  // NULL fails the save in the writer
+
+  rowchunk *c = E.rows;
+  while (c && c->left) c = c->left;
+  for (; c; c = c->next) {
+    int j;
+    for (j = 0; j < c->n; j++) editorSaveRow(&c->rows[j]);
+  }
+  SV.running = 1;
+  SV.copying = 0;
+  editorSaveSpawn();
+}
+
+void editorSaveFinish() {  // Waits for the writer and wraps up the save, or starts it copying the save in place
+  if (!pthread_equal(SV.thread, pthread_self())) pthread_join(SV.thread, NULL);
+  int counting = matchCountStop();  // The rows change under the search prompt's workers from here on
+  int moved = 0;  // Whether rows went between the mapping and the heap
+  int i;
+  for (i = 0; i < SV.nkeep; i++) textFree(SV.keep[i], SV.keepcap[i]);
+  SV.nkeep = 0;
+
+  if (SV.err == 0 && SV.inplace && !SV.copying) {  // The temporary file is done, the writer goes on to copy it
+    moved = editorSaveRepoint();
+    SV.copying = 1;  // The snapshot's been written, so its pins are let go
+    SV.written = SV.seen = 0;
+    editorSaveSpawn();
+    if (counting || moved) matchCountRestart(moved);
+    return;
+  }
+  int kept = SV.copying && SV.err;  // The copy over the real file failed, leaving SV.tmp behind
+  SV.running = 0;
+  SV.copying = 0;
+  if (kept) {
+    editorSetStatusMessage("Can't save! Text is in %s | I/O error: %s", SV.tmp, strerror(SV.err));
+  } else if (SV.err) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(SV.err));
+  } else {
+    if (E.dirty == SV.dirty) {  // Nothing changed since the snapshot, so the rows are the new file
+      editorRemapAfterSave(SV.target, SV.total);
+      E.dirty = 0;
+      moved = 1;
+    } else {
+      E.dirty -= SV.dirty;  // Only what was edited during the save is left unsaved
+    }
+    editorJournalRebase(SV.filename, SV.journal);
+    double secs = editorSeconds(&SV.start);
+    statAddNs(STAT_SAVEWRITE, secs * 1e9);
+    R.saved += SV.total;
+    R.savesecs += secs;
+    editorSetStatusMessage("%zu bytes written to disk (%.0f MB/s)", SV.total, secs > 0 ? SV.total / secs / 1e6 : 0.0);
+  }
+  if (SV.again) editorSaveStart();
+  if (counting || moved) matchCountRestart(moved);
+}
+
+int editorSavePoll() {  // Returns 1 if the save moved on since the last call
+  if (!SV.running) return 0;
+  if (__atomic_load_n(&SV.finished, __ATOMIC_ACQUIRE)) {
+    editorSaveFinish();
+    return 1;
+  }
+  size_t written = __atomic_load_n(&SV.written, __ATOMIC_RELAXED);
+  if (written == SV.seen) return 0;
+  SV.seen = written;
+  return 1;
+}
+
+void editorSaveWait() {  // Blocks until the save in progress, and any queued after it, is done
+  while (SV.running) editorSaveFinish();
+}
+
+void editorSave() {  // Saves text to file in the background
+  if (E.filename == NULL) {  // Prompts the user for a name if this is a new file
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+    if (E.filename == NULL) { // If user aborts
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  if (SV.running) {
+    SV.again = 1;
+    editorSetStatusMessage("Saving again once this save is done");
+    return;
+  }
+  uint64_t start = statNow();
+  editorSaveStart();
+  editorSavePoll();  // It may be done already
+  statAdd(STAT_SAVE, start);
+}
+
+void editorClose() {  // Drops every row, their text goes back to the allocator in one go
+  rowchunk *c = E.rows;
+  while (c && c->left) c = c->left;  // First chunk, then follow the chunk list
+  while (c) {
+    rowchunk *next = c->next;
+    xfree(c);
+    c = next;
+  }
+  E.rows = NULL;
+  E.rowcache = NULL;
+  E.numrows = 0;
+  E.hlvalid = 0;
+  renderCacheReset();
+  textReset();
+
+  if (E.map) munmap(E.map, E.maplen);
+  E.map = NULL;
+  E.maplen = 0;
+}
+
+/* search */
+
+char *editorMemSearch(const char *hay, size_t n, const char *q, size_t qlen) {
+  // Returns the first copy of q in hay, or NULL. Candidates are found by checking the first
+  // and last byte of q at 16 positions at once, and only those get compared in full
+  if (qlen == 0) return (char *)hay;
+  if (n < qlen) return NULL;
+  if (qlen == 1) return memchr(hay, q[0], n);
+
+  size_t last = n - qlen;  // Last position a match can start at
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(q[0]);
+  __m128i final = _mm_set1_epi8(q[qlen - 1]);
+  for (; i + 16 <= last + 1; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + qlen - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, q + 1, qlen - 2) == 0) return (char *)hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  while (i <= last) {  // The tail, or everything without SSE2: hop between copies of the first byte
+    const char *p = memchr(hay + i, q[0], last - i + 1);
+    if (p == NULL) return NULL;
+    if (p[qlen - 1] == q[qlen - 1] && memcmp(p + 1, q + 1, qlen - 2) == 0) return (char *)p;
+    i = p - hay + 1;
+  }
+  return NULL;
+}
+
+int editorRowFind(erow *row, int from, const char *q, int qlen) {
+  // Returns the index of the first match of q in row at or after from, or -1.
+  // Searches both sides of the gap where they are instead of closing it
+  if (from < 0) from = 0;
+  if (from + qlen > row->size) return -1;
+  int gaplen = row->cap - row->size;
+  char *p;
+
+  if (from < row->gap) {
+    p = editorMemSearch(&row->chars[from], row->gap - from, q, qlen);
+    if (p) return p - row->chars;
+
+    int at = row->gap - qlen + 1;  // Matches that start before the gap and end after it
+    if (at < from) at = from;
+    for (; at < row->gap && at + qlen <= row->size; at++) {
+      int j = 0;
+      while (j < qlen && ROW_CHAR(row, at + j) == q[j]) j++;
+      if (j == qlen) return at;
+    }
+    from = row->gap;
+  }
+
+  p = editorMemSearch(&row->chars[from + gaplen], row->size - from, q, qlen);
+  return p ? p - row->chars - gaplen : -1;
+}
+
+int editorRowFindLast(erow *row, int before, const char *q, int qlen) {  // Returns the last match starting before before, or -1
+  int last = -1;
+  int at = -1;
+  while ((at = editorRowFind(row, at + 1, q, qlen)) != -1 && at < before) last = at;
+  return last;
+}
+
+int editorRowsAdjacent(erow *a, erow *b) {  // Whether b follows a in the mapping with only a line ending between them
+  char *p = a->chars + a->size;
+  if (b->chars < p || b->chars - p > 2) return 0;
+  for (; p < b->chars; p++)
+    if (*p != '\n' && *p != '\r') return 0;
+  return 1;
+}
+
+int editorFindRows(int from, int to, const char *q, int qlen, int *cx) {
+  // Returns the first row in [from, to) with a match of q and sets *cx to where it starts, or -1.
+  // Unedited rows that sit back to back in the mapping are searched as one block. A query can't
+  // hold a line ending, so a match never runs from one of those rows into the next
+  if (from >= to) return -1;
+  int j = from;
+  rowchunk *c = rowTreeFind(E.rows, &j);
+  int first = from - j;  // Index of the chunk's first row
+
+  for (; c && first < to; first += c->n, c = c->next, j = 0) {
+    int end = to - first < c->n ? to - first : c->n;
+    while (j < end) {
+      erow *row = &c->rows[j];
+      if (!(row->flags & ROW_MAPPED)) {
+        int m = editorRowFind(row, 0, q, qlen);
+        if (m != -1) {
+          *cx = m;
+          return first + j;
+        }
+        j++;
+        continue;
+      }
+
+      int k = j + 1;
+      while (k < end && (c->rows[k].flags & ROW_MAPPED) && editorRowsAdjacent(&c->rows[k - 1], &c->rows[k])) k++;
+      char *stop = c->rows[k - 1].chars + c->rows[k - 1].size;
+      char *p = editorMemSearch(row->chars, stop - row->chars, q, qlen);
+      if (p) {
+        while (p >= c->rows[j].chars + c->rows[j].size) j++;  // Find the row the match is in
+        *cx = p - c->rows[j].chars;
+        return first + j;
+      }
+      j = k;
+    }
+  }
+  return -1;
+}
+
+/* regex */
+
+// Regular expressions are parsed straight into a Thompson NFA, once as written and once
+// back to front. Matching runs a DFA whose states are sets of NFA states, built only as
+// the text needs them, so every row is scanned in linear time with no backtracking.
+// Scanning a row backwards with the reversed NFA gives every position a match starts at
+// in one pass, and the forward NFA then finds how long the match at a position is.
+// Supported: literals, ., [] classes with ranges and ^, \d \w \s \D \W \S, escapes,
+// grouping, |, * + ?, and ^ or $ at the very start or end of the pattern.
+
+enum restatetype {
+  REGEX_CHAR,  // Consumes one byte in cls and goes to out
+  REGEX_SPLIT,  // Goes to both out and out1 without consuming anything
+  REGEX_EPS,  // Goes to out without consuming anything
+  REGEX_MATCH
+};
+
+typedef struct restate {
+  int type;
+  int out, out1;
+  unsigned char cls[32];  // Bitmap of the bytes an REGEX_CHAR state takes
+} restate;
+
+typedef struct reprog {  // One NFA
+  restate *states;
+  int n;
+  int cap;
+  int start;
+} reprog;
+
+typedef struct regex {
+  reprog fwd;  // Anchored, finds where a match that starts at some position ends
+  reprog rev;  // Reversed, and unanchored unless the pattern ends with $
+  int bol, eol;  // Pattern starts with ^ or ends with $
+} regex;
+
+typedef struct refrag {  // A piece of NFA under construction, end is an REGEX_EPS with no out yet
+  int start, end;
+} refrag;
+
+typedef struct redstate {  // One DFA state
+  int setoff, n;  // Its NFA states, sorted, in the DFA's pool
+  int match;  // Whether an REGEX_MATCH state is among them
+} redstate;
+
+typedef struct redfa {  // Lazily built DFA of a program, one per thread as it isn't shared
+  reprog *prog;
+  redstate *states;
+  int *next;  // 256 per state, the state after each byte or -1 until it's needed
+  int nstates;
+  int *pool;
+  int poolsize, poolcap;
+  int *table;  // Open addressing hash of state indices by NFA set, -1 for empty
+  int start;  // -1 until it's built
+  int *stack;  // Scratch space for closures and steps
+  int *set;
+  int *outs;
+  unsigned int *mark;
+  unsigned int gen;
+  long flushes;
+} redfa;
+
+#define REGEX_SET(cls, c) ((cls)[(unsigned char)(c) / 8] |= 1 << ((unsigned char)(c) % 8))
+#define REGEX_HAS(cls, c) ((cls)[(unsigned char)(c) / 8] & (1 << ((unsigned char)(c) % 8)))
+
+int regexState(reprog *p, int type, int out, int out1) {
+  if (p->n == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 64;
+    p->states = xrealloc(p->states, sizeof(restate) * p->cap);
+  }
+  restate *s = &p->states[p->n];
+  s->type = type;
+  s->out = out;
+  s->out1 = out1;
+  memset(s->cls, 0, sizeof(s->cls));
+  return p->n++;
+}
+
+refrag regexFragClass(reprog *p, unsigned char *cls) {  // A fragment matching one byte in cls
+  refrag f;
+  f.end = regexState(p, REGEX_EPS, -1, -1);
+  f.start = regexState(p, REGEX_CHAR, f.end, -1);
+  memcpy(p->states[f.start].cls, cls, 32);
+  return f;
+}
+
+refrag regexFragEmpty(reprog *p) {
+  refrag f;
+  f.start = f.end = regexState(p, REGEX_EPS, -1, -1);
+  return f;
+}
+
+void regexClassEscape(unsigned char *cls, int c) {  // Adds what \c stands for to cls
+  int j;
+  int negate = isupper(c);
+  unsigned char add[32] = {0};
+  switch (tolower(c)) {
+    case 'd':
+      for (j = '0'; j <= '9'; j++) REGEX_SET(add, j);
+      break;
+    case 'w':
+      for (j = 0; j < 256; j++) if (isalnum(j) || j == '_') REGEX_SET(add, j);
+      break;
+    case 's':
+      for (j = 0; j < 256; j++) if (isspace(j)) REGEX_SET(add, j);
+      break;
+    default:  // Any other escaped char stands for itself
+      REGEX_SET(cls, c == 't' ? '\t' : c);
+      return;
+  }
+  for (j = 0; j < 32; j++) cls[j] |= negate ? ~add[j] : add[j];
+}
+
+refrag regexParseAlt(reprog *p, const char **s, int rev, int *err);
+
+refrag regexParseAtom(reprog *p, const char **s, int rev, int *err) {
+  unsigned char cls[32] = {0};
+  int c = (unsigned char)*(*s)++;
+  int j;
+
+  if (c == '(') {
+    refrag f = regexParseAlt(p, s, rev, err);
+    if (**s != ')') *err = 1;
+    else (*s)++;
+    return f;
+  } else if (c == '.') {
+    memset(cls, 0xff, sizeof(cls));
+  } else if (c == '\\') {
+    if (**s == '\0') {
+      *err = 1;
+      return regexFragEmpty(p);
+    }
+    regexClassEscape(cls, (unsigned char)*(*s)++);
+  } else if (c == '[') {
+    int negate = (**s == '^');
+    if (negate) (*s)++;
+    int first = 1;  // A ] right at the start is just a char
+    while (**s && (**s != ']' || first)) {
+      int lo = (unsigned char)*(*s)++;
+      first = 0;
+      if (lo == '\\' && **s) {
+        regexClassEscape(cls, (unsigned char)*(*s)++);
+        continue;
+      }
+      int hi = lo;
+      if ((*s)[0] == '-' && (*s)[1] && (*s)[1] != ']') {
+        hi = (unsigned char)(*s)[1];
+        *s += 2;
+      }
+      for (j = lo; j <= hi; j++) REGEX_SET(cls, j);
+    }
+    if (**s != ']') {
+      *err = 1;
+      return regexFragEmpty(p);
+    }
+    (*s)++;
+    if (negate)
+      for (j = 0; j < 32; j++) cls[j] = ~cls[j];
+  } else if (c == '*' || c == '+' || c == '?' || c == ')') {  // Nothing to repeat, or a stray )
+    *err = 1;
+    return regexFragEmpty(p);
+  } else {
+    REGEX_SET(cls, c);
+  }
+  return regexFragClass(p, cls);
+}
+
+refrag regexParseRepeat(reprog *p, const char **s, int rev, int *err) {
+  refrag f = regexParseAtom(p, s, rev, err);
+  while (**s == '*' || **s == '+' || **s == '?') {
+    int op = *(*s)++;
+    int end = regexState(p, REGEX_EPS, -1, -1);
+    int split = regexState(p, REGEX_SPLIT, f.start, end);
+    if (op == '*') {  // split -> f -> split, or skip to end
+      p->states[f.end].out = split;
+      f.start = split;
+    } else if (op == '+') {  // f -> split -> f again, or on to end
+      p->states[f.end].out = split;
+    } else {  // split -> f -> end, or skip to end
+      p->states[f.end].out = end;
+      f.start = split;
+    }
+    f.end = end;
+  }
+  return f;
+}
+
+refrag regexParseConcat(reprog *p, const char **s, int rev, int *err) {
+  // Pieces are chained in the order they're written, or the other way around for the reversed NFA
+  refrag f = regexFragEmpty(p);
+  while (**s && **s != '|' && **s != ')' && !*err) {
+    refrag next = regexParseRepeat(p, s, rev, err);
+    if (rev) {
+      p->states[next.end].out = f.start;
+      f.start = next.start;
+    } else {
+      p->states[f.end].out = next.start;
+      f.end = next.end;
+    }
+  }
+  return f;
+}
+
+refrag regexParseAlt(reprog *p, const char **s, int rev, int *err) {
+  refrag f = regexParseConcat(p, s, rev, err);
+  while (**s == '|' && !*err) {
+    (*s)++;
+    refrag other = regexParseConcat(p, s, rev, err);
+    int end = regexState(p, REGEX_EPS, -1, -1);
+    int split = regexState(p, REGEX_SPLIT, f.start, other.start);
+    p->states[f.end].out = end;
+    p->states[other.end].out = end;
+    f.start = split;
+    f.end = end;
+  }
+  return f;
+}
+
+int regexBuild(reprog *p, const char *pattern, int len, int rev, int unanchored) {
+  // Compiles len chars of pattern into p, returns -1 if it isn't a valid regex
+  char *body = xstrndup(pattern, len);
+  const char *s = body;
+  int err = 0;
+  p->n = 0;
+  refrag f = regexParseAlt(p, &s, rev, &err);
+  if (*s != '\0') err = 1;  // A ) with no (
+  xfree(body);
+  if (err) return -1;
+
+  int match = regexState(p, REGEX_MATCH, -1, -1);  // Can move states, so not straight into the assignment
+  p->states[f.end].out = match;
+  p->start = f.start;
+  if (unanchored) {  // Loop over any byte first, so a match can begin anywhere
+    unsigned char any[32];
+    memset(any, 0xff, sizeof(any));
+    int loop = regexState(p, REGEX_SPLIT, p->start, -1);
+    int skip = regexState(p, REGEX_CHAR, loop, -1);
+    memcpy(p->states[skip].cls, any, 32);
+    p->states[loop].out1 = skip;
+    p->start = loop;
+  }
+  return 0;
+}
+
+int regexCompile(regex *re, const char *pattern) {  // Returns -1 if pattern isn't a valid regex, regexFree() re either way
+  memset(re, 0, sizeof(*re));
+  int len = strlen(pattern);
+  re->bol = (len > 0 && pattern[0] == '^');
+  if (re->bol) {
+    pattern++;
+    len--;
+  }
+  re->eol = (len > 0 && pattern[len - 1] == '$' && (len < 2 || pattern[len - 2] != '\\'));
+  if (re->eol) len--;
+
+  if (regexBuild(&re->fwd, pattern, len, 0, 0) == -1) return -1;
+  return regexBuild(&re->rev, pattern, len, 1, !re->eol);
+}
+
+void regexFree(regex *re) {
+  xfree(re->fwd.states);
+  xfree(re->rev.states);
+  memset(re, 0, sizeof(*re));
+}
+
+void regexDfaFlush(redfa *d) {  // Forgets every state, for when there are too many
+  d->nstates = 0;
+  d->poolsize = 0;
+  d->start = -1;
+  memset(d->table, -1, sizeof(int) * REGEX_DFA_STATES * 2);
+  d->flushes++;
+}
+
+void regexDfaInit(redfa *d, reprog *prog) {
+  d->prog = prog;
+  d->states = xmalloc(sizeof(redstate) * REGEX_DFA_STATES);
+  d->next = xmalloc(sizeof(int) * 256 * REGEX_DFA_STATES);
+  d->table = xmalloc(sizeof(int) * REGEX_DFA_STATES * 2);
+  d->pool = NULL;
+  d->poolcap = 0;
+  d->stack = xmalloc(sizeof(int) * prog->n * 3);  // Each state pushes at most two more
+  d->set = xmalloc(sizeof(int) * prog->n);
+  d->outs = xmalloc(sizeof(int) * prog->n);
+  d->mark = xcalloc(prog->n, sizeof(unsigned int));
+  d->gen = 0;
+  d->flushes = -1;
+  regexDfaFlush(d);
+}
+
+void regexDfaFree(redfa *d) {
+  xfree(d->states);
+  xfree(d->next);
+  xfree(d->table);
+  xfree(d->pool);
+  xfree(d->stack);
+  xfree(d->set);
+  xfree(d->outs);
+  xfree(d->mark);
+  memset(d, 0, sizeof(*d));
+}
+
+int regexIntCmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+int regexDfaAdd(redfa *d, int n) {  // Returns the state for the n NFA states in d->set, making it if needed
+  qsort(d->set, n, sizeof(int), regexIntCmp);
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < n; i++) h = (h ^ d->set[i]) * 16777619u;
+
+  int slot = h % (REGEX_DFA_STATES * 2);
+  while (d->table[slot] != -1) {
+    redstate *ds = &d->states[d->table[slot]];
+    if (ds->n == n && memcmp(&d->pool[ds->setoff], d->set, sizeof(int) * n) == 0) return d->table[slot];
+    slot = (slot + 1) % (REGEX_DFA_STATES * 2);
+  }
+
+  if (d->nstates == REGEX_DFA_STATES) return -1;  // Caller has to flush and try again
+  if (d->poolsize + n > d->poolcap) {
+    d->poolcap = (d->poolsize + n) * 2;
+    d->pool = xrealloc(d->pool, sizeof(int) * d->poolcap);
+  }
+  redstate *ds = &d->states[d->nstates];
+  ds->setoff = d->poolsize;
+  ds->n = n;
+  ds->match = 0;
+  memcpy(&d->pool[d->poolsize], d->set, sizeof(int) * n);
+  d->poolsize += n;
+  for (i = 0; i < n; i++)
+    if (d->prog->states[d->set[i]].type == REGEX_MATCH) ds->match = 1;
+  memset(&d->next[d->nstates * 256], -1, sizeof(int) * 256);
+  d->table[slot] = d->nstates;
+  return d->nstates++;
+}
+
+int regexDfaClosure(redfa *d, int *from, int nfrom) {
+  // Follows every non-consuming edge out of the nfrom NFA states, leaving the consuming
+  // and matching states reached in d->set. Returns how many there are
+  reprog *p = d->prog;
+  int n = 0, top = 0;
+  int i;
+  d->gen++;
+  for (i = 0; i < nfrom; i++) d->stack[top++] = from[i];
+  while (top > 0) {
+    int s = d->stack[--top];
+    if (s < 0 || d->mark[s] == d->gen) continue;
+    d->mark[s] = d->gen;
+    restate *st = &p->states[s];
+    if (st->type == REGEX_SPLIT) {
+      d->stack[top++] = st->out1;
+      d->stack[top++] = st->out;
+    } else if (st->type == REGEX_EPS) {
+      d->stack[top++] = st->out;
+    } else {
+      d->set[n++] = s;
+    }
+  }
+  return n;
+}
+
+int regexDfaStart(redfa *d) {
+  if (d->start == -1) {
+    int n = regexDfaClosure(d, &d->prog->start, 1);
+    d->start = regexDfaAdd(d, n);
+    if (d->start == -1) {
+      regexDfaFlush(d);
+      n = regexDfaClosure(d, &d->prog->start, 1);
+      d->start = regexDfaAdd(d, n);
+    }
+  }
+  return d->start;
+}
+
+int regexDfaStep(redfa *d, int state, int c) {  // Returns the state after byte c
+  int next = d->next[state * 256 + c];
+  if (next != -1) return next;
+
+  redstate *ds = &d->states[state];
+  int *outs = d->outs;
+  int nouts = 0;
+  int i;
+  for (i = 0; i < ds->n; i++) {
+    restate *st = &d->prog->states[d->pool[ds->setoff + i]];
+    if (st->type == REGEX_CHAR && REGEX_HAS(st->cls, c)) outs[nouts++] = st->out;
+  }
+  int n = regexDfaClosure(d, outs, nouts);
+  next = regexDfaAdd(d, n);
+  if (next == -1) {  // Full, start over with just the state we need
+    regexDfaFlush(d);
+    n = regexDfaClosure(d, outs, nouts);
+    next = regexDfaAdd(d, n);
+  } else {
+    d->next[state * 256 + c] = next;
+  }
+  return next;
+}
+
+long regexRowStarts(regex *re, redfa *rev, erow *row, int from, int to, int *first, int *last, char *marks) {
+  // Counts the positions in [from, to) where a match starts, in one pass over the row from its
+  // end. *first and *last are set to the lowest and highest of them, or -1, and marks[i - from]
+  // to 1 for each of them. Any of the three can be NULL, and with only last asked for the pass
+  // stops at the first start it sees
+  long count = 0;
+  int lo = -1, hi = -1;
+  if (to > row->size + 1) to = row->size + 1;
+  if (from < 0) from = 0;
+
+  if (from < to) {
+    int state = regexDfaStart(rev);
+    int *next = rev->next;  // Neither table moves, a flush only empties them
+    redstate *states = rev->states;
+    const char *chars = row->chars;
+    int gap = row->gap, gaplen = row->cap - row->size;
+    int i;
+    for (i = row->size; i >= from; i--) {  // state has read the chars from i to the end of the row, backwards
+      if (states[state].match && i < to && (!re->bol || i == 0)) {
+        count++;
+        lo = i;
+        if (hi == -1) hi = i;
+        if (marks) marks[i - from] = 1;
+        if (last && !first && !marks) break;
+      }
+      if (i == from) break;
+      unsigned char ch = chars[i - 1 < gap ? i - 1 : i - 1 + gaplen];
+      int to_state = next[state * 256 + ch];  // Known transitions are looked up without a call
+      if (to_state == state && !states[state].match) {
+        // Run over the bytes that leave the DFA where it is, none of them can start a match.
+        // With the state fixed the lookups don't wait on each other
+        while (i - 1 > from && next[state * 256 + (unsigned char)chars[i - 2 < gap ? i - 2 : i - 2 + gaplen]] == state) i--;
+        continue;
+      }
+      state = to_state != -1 ? to_state : regexDfaStep(rev, state, ch);
+      if (re->eol && states[state].n == 0) break;  // Anchored to the end and nothing can match any more
+    }
+  }
+  if (first) *first = lo;
+  if (last) *last = hi;
+  return count;
+}
+
+int regexMatchLen(regex *re, redfa *fwd, erow *row, int at, int limit) {
+  // Returns the length of the longest match starting at at, or -1. Stops early once a match
+  // reaches limit, as nothing past it is needed
+  if (re->bol && at != 0) return -1;
+  int state = regexDfaStart(fwd);
+  int best = (fwd->states[state].match && (!re->eol || at == row->size)) ? 0 : -1;
+  int j;
+  for (j = at; j < row->size && at + best < limit; j++) {
+    unsigned char ch = ROW_CHAR(row, j);
+    int next = fwd->next[state * 256 + ch];
+    state = next != -1 ? next : regexDfaStep(fwd, state, ch);
+    if (fwd->states[state].n == 0) break;  // Dead, nothing longer can match
+    if (fwd->states[state].match && (!re->eol || j + 1 == row->size)) best = j + 1 - at;
+  }
+  return best;
+}
+
+long regexRowMatches(regex *re, redfa *fwd, redfa *rev, erow *row, int to, char *marks) {
+  // Counts the matches starting before to, taken leftmost-longest and without overlaps from the
+  // start of the row, the way they would be replaced: each one is looked for after the end of
+  // the last, and empty ones don't count. Leaves marks[i] set to 1 at the start of each of them
+  // and 0 everywhere else, marks needs room for the smaller of to and row->size + 1
+  if (to > row->size + 1) to = row->size + 1;
+  if (to <= 0) return 0;
+  memset(marks, 0, to);
+  if (regexRowStarts(re, rev, row, 0, to, NULL, NULL, marks) == 0) return 0;
+
+  long count = 0;
+  char *p = marks, *end = marks + to;
+  while ((p = memchr(p, 1, end - p)) != NULL) {
+    int len = regexMatchLen(re, fwd, row, p - marks, INT_MAX);
+    if (len <= 0) {  // Empty, nothing to find or replace
+      *p++ = 0;
+      continue;
+    }
+    count++;
+    char *next = p + len < end ? p + len : end;
+    memset(p + 1, 0, next - p - 1);  // Starts inside this match are taken by it
+    p = next;
+  }
+  return count;
+}
+
+char *regexMarks(char **marks, int *cap, int n) {  // Grows a marks buffer to n bytes
+  if (n > *cap) {
+    *cap = n < INT_MAX / 2 ? n * 2 : n;
+    *marks = xrealloc(*marks, *cap);
+  }
+  return *marks;
+}
+
+/* match counting */
+
+// While the search prompt is up, worker threads count every match of the query, taking one
+// row chunk at a time. Unedited rows are views into the read-only mapping and can't change
+// until the prompt is closed. Edited rows have their gap closed before the workers start, and
+// nothing opens it again while the prompt is up, so the workers read those as they are too.
+//
+// Every query typed keeps what it found as a level: its count and which rows matched in each
+// chunk. A row can only match a longer query if it matched every prefix of it, so a chunk
+// already done by a shorter query only needs its matching rows looked at again. Going back
+// to an earlier query with backspace picks its level up again, finished or not.
+//
+// A regex query is counted the same way, by matches starting in each row, but a longer
+// regex doesn't narrow a shorter one down, so only a level of the very same regex is reused.
+
+typedef struct matchlevel {
+  char *query;
+  long *counts;  // Matches in each chunk
+  unsigned char *rows;  // ROWS_CHUNK / 8 bytes per chunk, a bit set for each row with a match
+  char *done;  // Whether each chunk has been counted
+  long total;  // Every match in the file, -1 until every chunk is counted
+} matchlevel;
+
+struct matchCounter {
+  pthread_t threads[MATCH_THREADS_MAX];
+  int nthreads;  // Workers still to be joined
+  char *query;  // NULL when no search is going on
+  int qlen;
+  matchlevel levels[MATCH_CACHE_LEVELS];  // Each query is a prefix of the ones after it
+  int nlevels;
+  matchlevel *level;  // Level of the query being counted, the last one
+  rowchunk **chunks;  // Every chunk in file order, only valid while there are levels
+  int *first;  // Index of each chunk's first row
+  int nchunks;
+  int chunkcap;
+  int next;  // Next chunk to be handed out
+  int todo;  // Chunks the workers have to count
+  int done;  // How many of those they have
+  int seen;  // What done was when the main thread last looked
+  int cancel;
+  long found;  // Matches counted so far, for showing progress
+  int at, cx;  // Match the cursor is on, at is -1 if there is none
+  long index;  // Number of that match counting from 1, 0 if not worked out yet
+  int onscreen;  // Matches drawn on the last frame
+  int useregex;  // Whether queries are regexes, toggled with Ctrl-T in the prompt
+  int badregex;  // The query isn't a valid regex
+  regex re;  // The query compiled, when it's a regex
+  redfa fwd, rev;  // The main thread's DFAs for re, every worker makes its own rev
+};
+
+struct matchCounter MC;
+
+#define MATCH_ROW_BIT(bits, j) ((bits)[(j) / 8] & (1 << ((j) % 8)))
+
+long matchCountRun(rowchunk *c, int j, int k, unsigned char *bits) {
+  // Counts the matches in rows j to k of c, which have to be back to back in the mapping or
+  // be a single row, and sets the bits of the rows they're in
+  char *s = c->rows[j].chars;
+  char *stop = c->rows[k - 1].chars + c->rows[k - 1].size;
+  char *p;
+  long count = 0;
+  while ((p = editorMemSearch(s, stop - s, MC.query, MC.qlen)) != NULL) {
+    while (p >= c->rows[j].chars + c->rows[j].size) j++;  // Matches never span rows, see editorFindRows()
+    bits[j / 8] |= 1 << (j % 8);
+    count++;
+    s = p + 1;
+  }
+  return count;
+}
+
+long matchCountRow(erow *row, int before) {  // Counts matches in row starting before before, main thread only
+  static char *marks = NULL;
+  static int markcap = 0;
+  if (MC.useregex) {
+    int n = before < row->size + 1 ? before : row->size + 1;
+    return regexRowMatches(&MC.re, &MC.fwd, &MC.rev, row, before, regexMarks(&marks, &markcap, n));
+  }
+  long count = 0;
+  int at = -1;
+  while ((at = editorRowFind(row, at + 1, MC.query, MC.qlen)) != -1 && at < before) count++;
+  return count;
+}
+
+void *matchCountWorker(void *arg) {
+  (void)arg;
+  matchlevel *lv = MC.level;
+  redfa fwd, rev;
+  char *marks = NULL;
+  int markcap = 0;
+  if (MC.useregex) {
+    regexDfaInit(&fwd, &MC.re.fwd);
+    regexDfaInit(&rev, &MC.re.rev);
+  }
+  int i;
+  while (!__atomic_load_n(&MC.cancel, __ATOMIC_RELAXED) &&
+         (i = __atomic_fetch_add(&MC.next, 1, __ATOMIC_RELAXED)) < MC.nchunks) {
+    if (lv->done[i]) continue;  // Counted before the query last changed
+
+    matchlevel *filter = NULL;  // Shortest set of rows that can still match
+    int l;
+    for (l = MC.useregex ? -1 : MC.nlevels - 2; l >= 0 && filter == NULL; l--)
+      if (MC.levels[l].done[i]) filter = &MC.levels[l];
+
+    rowchunk *c = MC.chunks[i];
+    unsigned char *bits = &lv->rows[i * (ROWS_CHUNK / 8)];
+    long count = 0;
+    int j = 0;
+    while (j < c->n) {
+      if (MC.useregex) {  // A row at a time, a regex can't run over a line ending
+        erow *row = &c->rows[j];
+        long n = regexRowMatches(&MC.re, &fwd, &rev, row, INT_MAX, regexMarks(&marks, &markcap, row->size + 1));
+        if (n) bits[j / 8] |= 1 << (j % 8);
+        count += n;
+        j++;
+        continue;
+      }
+      unsigned char *fbits = filter ? &filter->rows[i * (ROWS_CHUNK / 8)] : NULL;
+      if (fbits && !MATCH_ROW_BIT(fbits, j)) {
+        j++;
+        continue;
+      }
+      int k = j + 1;  // Same blocks of back to back rows as editorFindRows(), made of rows that can match
+      while ((c->rows[j].flags & ROW_MAPPED) && k < c->n && (c->rows[k].flags & ROW_MAPPED) &&
+             (!fbits || MATCH_ROW_BIT(fbits, k)) && editorRowsAdjacent(&c->rows[k - 1], &c->rows[k])) k++;
+      count += matchCountRun(c, j, k, bits);
+      j = k;
+    }
+
+    lv->counts[i] = count;
+    lv->done[i] = 1;
+    __atomic_fetch_add(&MC.found, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&MC.done, 1, __ATOMIC_RELEASE);  // Publishes what was written for chunk i
+  }
+  if (MC.useregex) {
+    regexDfaFree(&fwd);
+    regexDfaFree(&rev);
+    xfree(marks);
+  }
+  editorWake();  // The last worker to stop brings the count to an end
+  return NULL;
+}
+
+int matchCountStop() {
+  // Cancels the count and waits for the workers, they stop after their current chunk. Returns
+  // whether there were any
+  int t, n = MC.nthreads;
+  __atomic_store_n(&MC.cancel, 1, __ATOMIC_RELAXED);
+  for (t = 0; t < MC.nthreads; t++) pthread_join(MC.threads[t], NULL);
+  MC.nthreads = 0;
+  return n > 0;
+}
+
+void matchLevelFree(matchlevel *lv) {
+  xfree(lv->query);
+  xfree(lv->counts);
+  xfree(lv->rows);
+  xfree(lv->done);
+}
+
+void matchCountChunks() {
+  // Lists the chunks, they stay put for as long as the prompt is up. Closes the gap of every
+  // edited row on the way, for the workers to read it in one piece
+  MC.nchunks = 0;
+  int first = 0;
+  rowchunk *c = E.rows;
+  while (c && c->left) c = c->left;
+  for (; c; c = c->next) {
+    if (MC.nchunks == MC.chunkcap) {
+      MC.chunkcap = MC.chunkcap ? MC.chunkcap * 2 : 64;
+      MC.chunks = xrealloc(MC.chunks, sizeof(rowchunk *) * MC.chunkcap);
+      MC.first = xrealloc(MC.first, sizeof(int) * MC.chunkcap);
+    }
+    MC.chunks[MC.nchunks] = c;
+    MC.first[MC.nchunks] = first;
+    MC.nchunks++;
+    int j;
+    for (j = 0; j < c->n; j++) editorRowChars(&c->rows[j]);
+    first += c->n;
+  }
+}
+
+void matchCountFinish() {  // Adds the chunks up once every one of them is in
+  matchlevel *lv = MC.level;
+  long total = 0;
+  int i;
+  for (i = 0; i < MC.nchunks; i++) total += lv->counts[i];
+  lv->total = total;
+}
+
+void matchCountWait() {  // Waits for the workers to get through every chunk and finishes the count
+  int t;
+  for (t = 0; t < MC.nthreads; t++) pthread_join(MC.threads[t], NULL);
+  MC.nthreads = 0;
+  if (MC.level->total < 0) matchCountFinish();
+}
+
+int matchCountStart(const char *query) {
+  // Starts counting the matches of query, picking up where an earlier count of it or of
+  // one of its prefixes left off. Returns -1 if query is meant as a regex and isn't one
+  matchCountStop();
+  xfree(MC.query);
+  MC.query = NULL;
+  if (MC.useregex) {
+    regexDfaFree(&MC.fwd);
+    regexDfaFree(&MC.rev);
+    regexFree(&MC.re);
+    MC.badregex = (regexCompile(&MC.re, query) == -1);
+    if (MC.badregex) {
+      regexFree(&MC.re);
+      return -1;
+    }
+    regexDfaInit(&MC.fwd, &MC.re.fwd);
+    regexDfaInit(&MC.rev, &MC.re.rev);
+  }
+  MC.query = xstrdup(query);
+  MC.qlen = strlen(query);
+  if (MC.nlevels == 0) matchCountChunks();
+
+  while (MC.nlevels > 0) {  // Drop the levels that aren't a prefix of the query
+    matchlevel *top = &MC.levels[MC.nlevels - 1];
+    if (strncmp(top->query, query, MC.useregex ? INT_MAX : strlen(top->query)) == 0) break;
+    matchLevelFree(top);
+    MC.nlevels--;
+  }
+
+  if (MC.nlevels == 0 || strcmp(MC.levels[MC.nlevels - 1].query, query) != 0) {
+    if (MC.nlevels == MATCH_CACHE_LEVELS) {  // Full, forget the shortest query
+      matchLevelFree(&MC.levels[0]);
+      memmove(&MC.levels[0], &MC.levels[1], sizeof(matchlevel) * (MC.nlevels - 1));
+      MC.nlevels--;
+    }
+    matchlevel *lv = &MC.levels[MC.nlevels++];
+    lv->query = xstrdup(query);
+    lv->counts = xcalloc(MC.nchunks ? MC.nchunks : 1, sizeof(long));
+    lv->rows = xcalloc(MC.nchunks ? MC.nchunks : 1, ROWS_CHUNK / 8);
+    lv->done = xcalloc(MC.nchunks ? MC.nchunks : 1, 1);
+    lv->total = -1;
+  }
+  MC.level = &MC.levels[MC.nlevels - 1];
+  MC.at = -1;
+  MC.index = 0;
+  if (MC.level->total >= 0) return 0;  // Counted all the way already
+
+  int i;
+  MC.todo = 0;
+  MC.found = 0;
+  for (i = 0; i < MC.nchunks; i++) {
+    if (MC.level->done[i]) MC.found += MC.level->counts[i];
+    else MC.todo++;
+  }
+  MC.next = MC.done = MC.seen = 0;
+  MC.cancel = 0;
+  if (MC.todo == 0) {
+    matchCountFinish();
+    return 0;
+  }
+
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) n = 1;
+  if (n > MATCH_THREADS_MAX) n = MATCH_THREADS_MAX;
+  while (MC.nthreads < n && pthread_create(&MC.threads[MC.nthreads], NULL, matchCountWorker, NULL) == 0)
+    MC.nthreads++;
+  if (MC.nthreads == 0) matchCountWorker(NULL);  // No threads to be had, so count right here
+  return 0;
+}
+
+void matchCountEnd() {  // Stops showing the count, the levels stay until the prompt closes
+  matchCountStop();
+  xfree(MC.query);
+  MC.query = NULL;
+  MC.badregex = 0;
+}
+
+void matchCacheClear() {  // Forgets every level, rows can move once the prompt is closed
+  matchCountEnd();
+  while (MC.nlevels > 0) matchLevelFree(&MC.levels[--MC.nlevels]);
+  MC.level = NULL;
+  regexDfaFree(&MC.fwd);
+  regexDfaFree(&MC.rev);
+  regexFree(&MC.re);
+}
+
+void matchCountRestart(int forget) {
+  // Starts the workers again after matchCountStop(). With forget, rows went between the mapping
+  // and the heap in between, which the levels can't follow, so the count starts over
+  char *query = MC.query ? xstrdup(MC.query) : NULL;
+  int useregex = MC.useregex, at = MC.at, cx = MC.cx;
+  if (forget) {
+    matchCacheClear();
+    MC.useregex = useregex;
+  }
+  if (query && matchCountStart(query) == 0) {  // Still on the same match
+    MC.at = at;
+    MC.cx = cx;
+  }
+  xfree(query);
+}
+
+int matchCountPoll() {  // Returns 1 if the count moved on since the last call
+  if (MC.query == NULL || MC.level->total != -1) return 0;
+  int done = __atomic_load_n(&MC.done, __ATOMIC_ACQUIRE);
+  if (done == MC.seen) return 0;
+  MC.seen = done;
+
+  if (done == MC.todo) {
+    matchCountStop();
+    matchCountFinish();
+  }
+  return 1;
+}
+
+int matchCountChunkOf(int at) {  // Index of the chunk holding row at
+  int lo = 0, hi = MC.nchunks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (MC.first[mid] <= at) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+long matchCountIndex() {  // Returns the number of the match the cursor is on, 0 if it isn't known yet
+  if (MC.level->total < 0 || MC.at < 0) return 0;
+  if (MC.index) return MC.index;
+
+  int ci = matchCountChunkOf(MC.at);
+  long index = 1;
+  int i;
+  for (i = 0; i < ci; i++) index += MC.level->counts[i];
+  rowchunk *c = MC.chunks[ci];
+  unsigned char *bits = &MC.level->rows[ci * (ROWS_CHUNK / 8)];
+  for (i = 0; MC.first[ci] + i < MC.at; i++)
+    if (MATCH_ROW_BIT(bits, i)) index += matchCountRow(&c->rows[i], INT_MAX);
+  index += matchCountRow(&c->rows[MC.at - MC.first[ci]], MC.cx);
+  MC.index = index;
+  return index;
+}
+
+matchlevel *matchCacheLevel(const char *query) {  // Longest fully counted query that query starts with, or NULL
+  int i;
+  for (i = MC.nlevels - 1; i >= 0; i--) {
+    matchlevel *lv = &MC.levels[i];
+    if (lv->total >= 0 && strncmp(lv->query, query, MC.useregex ? INT_MAX : strlen(lv->query)) == 0) return lv;
+  }
+  return NULL;
+}
+
+int matchCacheStep(matchlevel *lv, int row, int dir) {  // Returns the next row after row (dir 1) or before it (dir -1) with a match in lv, or -1
+  int at = row + dir;
+  if (at < 0 || at >= E.numrows) return -1;
+  int ci = matchCountChunkOf(at);
+  int j = at - MC.first[ci];
+  while (ci >= 0 && ci < MC.nchunks) {
+    if (lv->counts[ci]) {
+      unsigned char *bits = &lv->rows[ci * (ROWS_CHUNK / 8)];
+      for (; j >= 0 && j < MC.chunks[ci]->n; j += dir)
+        if (MATCH_ROW_BIT(bits, j)) return MC.first[ci] + j;
+    }
+    ci += dir;
+    if (ci >= 0 && ci < MC.nchunks) j = dir > 0 ? 0 : MC.chunks[ci]->n - 1;
+  }
+  return -1;
+}
+
+/* find */
+
+int editorFindNext(int *at, int *cx, const char *q, int qlen) {
+  // Moves *at and *cx to the first match at or after them, wrapping around the end of the file.
+  // Returns 0 if there's no match anywhere
+  if (*at < E.numrows) {
+    int m = editorRowFind(editorRowAt(*at), *cx, q, qlen);
+    if (m != -1) {
+      *cx = m;
+      return 1;
+    }
+  }
+
+  matchlevel *lv = matchCacheLevel(q);
+  if (lv) {  // Only rows that matched the query or a prefix of it can match
+    int row = *at;
+    int wrapped = 0;
+    while (1) {
+      row = matchCacheStep(lv, row, 1);
+      if (row == -1 && !wrapped) {
+        wrapped = 1;
+        row = matchCacheStep(lv, -1, 1);
+      }
+      if (row == -1 || (wrapped && row > *at)) return 0;
+      int m = editorRowFind(editorRowAt(row), 0, q, qlen);
+      if (m != -1) {
+        *at = row;
+        *cx = m;
+        return 1;
+      }
+    }
+  }
+
+  int row = editorFindRows(*at + 1, E.numrows, q, qlen, cx);
+  if (row == -1) row = editorFindRows(0, *at < E.numrows ? *at + 1 : E.numrows, q, qlen, cx);
+  if (row == -1) return 0;
+  *at = row;
+  return 1;
+}
+
+int editorFindPrev(int *at, int *cx, const char *q, int qlen) {  // Like editorFindNext() but goes backwards from before *cx
+  int m = editorRowFindLast(editorRowAt(*at), *cx, q, qlen);
+  if (m != -1) {
+    *cx = m;
+    return 1;
+  }
+
+  matchlevel *lv = matchCacheLevel(q);
+  int row = *at;
+  int wrapped = 0;
+  while (1) {
+    row = lv ? matchCacheStep(lv, row, -1) : row - 1;
+    if (row == -1 && !wrapped) {  // Wrap around to the end of the file
+      wrapped = 1;
+      row = lv ? matchCacheStep(lv, E.numrows, -1) : E.numrows - 1;
+    }
+    if (row == -1 || (wrapped && row < *at)) return 0;
+    m = editorRowFindLast(editorRowAt(row), INT_MAX, q, qlen);
+    if (m != -1) {
+      *at = row;
+      *cx = m;
+      return 1;
+    }
+  }
+}
+
+int editorFindRegex(int *at, int *cx, int dir) {
+  // editorFindNext() (dir 1) or editorFindPrev() (dir -1) for the regex being counted
+  matchlevel *lv = matchCacheLevel(MC.query);
+  int row = *at;
+  int wrapped = 0;
+  int from = *cx;  // Only the first row searched is cut short
+  static char *marks = NULL;
+  static int markcap = 0;
+  while (1) {
+    erow *r = editorRowAt(row);
+    int to = r->size + 1;
+    if (dir < 0 && from < to) to = from;
+    int m = -1;
+    if (regexRowMatches(&MC.re, &MC.fwd, &MC.rev, r, to, regexMarks(&marks, &markcap, to))) {
+      if (dir > 0) {  // The first match at or after from, they can only be told apart from the row start
+        char *p = from < to ? memchr(marks + from, 1, to - from) : NULL;
+        if (p) m = p - marks;
+      } else {
+        for (m = to - 1; m >= 0 && !marks[m]; m--);
+      }
+    }
+    if (m != -1) {
+      *at = row;
+      *cx = m;
+      return 1;
+    }
+    from = dir > 0 ? 0 : INT_MAX;
+
+    row = lv ? matchCacheStep(lv, row, dir) : row + dir;
+    if ((row < 0 || row >= E.numrows) && !wrapped) {
+      wrapped = 1;
+      if (lv) row = matchCacheStep(lv, dir > 0 ? -1 : E.numrows, dir);
+      else row = dir > 0 ? 0 : E.numrows - 1;
+    }
+    if (row < 0 || row >= E.numrows || (wrapped && (dir > 0 ? row > *at : row < *at))) return 0;
+  }
+}
+
+void editorFindCallback(char *query, int key) {
+  static int last_match = -1;  // Row of the match the cursor is on
+  static int last_cx = 0;
+  static int direction = 1;
+
+  if (key == BG_EVENT) return;  // Only the match count changed, nothing to search for
+
+  if (key == CTRL_KEY('t')) {  // Switch between plain text and regex, nothing counted carries over
+    MC.useregex = !MC.useregex;
+    matchCacheClear();
+  }
+
+  if (key == '\r' || key == '\x1b') {  // return immediately instead of doing another search
+    last_match = -1;  // Reset static variables when we exit
+    direction = 1;
+    matchCacheClear();
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {  // If arrow key not pressed reset last_match to -1
+    last_match = -1;
+    direction = 1;
+  }
+
+  int qlen = strlen(query);
+  if (qlen == 0 || E.numrows == 0) {
+    matchCountEnd();
+    return;
+  }
+  if (MC.query == NULL || strcmp(MC.query, query) != 0) {  // Count the new query's matches in the background
+    if (matchCountStart(query) == -1) return;  // Not a valid regex (yet), the status bar says so
+    matchCountPoll();
+  }
+
+  int at = 0, cx = 0;  // A new query searches from the top of the file
+  int found;
+  if (last_match != -1) {
+    at = last_match;
+    cx = direction == 1 ? last_cx + 1 : last_cx;  // Every match in a row gets a turn before moving on
+  }
+  if (MC.useregex) found = editorFindRegex(&at, &cx, direction);
+  else if (direction == 1) found = editorFindNext(&at, &cx, query, qlen);
+  else found = editorFindPrev(&at, &cx, query, qlen);
+
+  if (found) {
+    last_match = at;
+    last_cx = cx;
+    MC.at = at;
+    MC.cx = cx;
+    MC.index = 0;
+    E.cy = at;
+    E.cx = cx;  // Already an index into chars, editorScroll() turns it into a render column
+    E.rowoff = E.numrows;  // Sets rowoff to the bottom so that when we refresh the screen, the matching line will be at the top of the screen
+  }
+}
+
+void editorFind() {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-T = regex)", editorFindCallback, 0);
+
+  if(query) {
+    xfree(query);
+  } else {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/* replace */
+
+void editorReplaceAll(const char *q, const char *with) {
+  // Replaces every copy of q in the file. The match counting workers find the rows with a
+  // copy in them, then each of those rows is rebuilt once
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int qlen = strlen(q), wlen = strlen(with);
+  char *both = xmalloc(qlen + wlen + 1);
+  memcpy(both, q, qlen);
+  memcpy(&both[qlen], with, wlen);
+  editorJournal(JOURNAL_REPLACE, 0, qlen, both, qlen + wlen);
+  editorUndoRecord(UNDO_REPLACE, 0, qlen, both, qlen + wlen);
+  xfree(both);
+
+  int useregex = MC.useregex;  // Replacing is always by plain text
+  MC.useregex = 0;
+  matchCacheClear();
+  matchCountStart(q);
+  matchCountWait();
+
+  long replaced = 0, rows = 0;
+  int first = -1;
+  int i, j;
+  size_t before = 0;  // What the undo log needs for the rows as they are now
+  for (i = 0; i < MC.nchunks; i++) {
+    if (MC.level->counts[i] == 0) continue;
+    unsigned char *bits = &MC.level->rows[i * (ROWS_CHUNK / 8)];
+    for (j = 0; j < MC.chunks[i]->n; j++)
+      if (MATCH_ROW_BIT(bits, j)) before += sizeof(undoop) + MC.chunks[i]->rows[j].size;
+  }
+  int undoable = U.paused || before <= UNDO_MEMORY;
+  if (!undoable) editorUndoForget();  // Instead of copying it all only to drop it again
+
+  for (i = 0; i < MC.nchunks; i++) {
+    if (MC.level->counts[i] == 0) continue;
+    unsigned char *bits = &MC.level->rows[i * (ROWS_CHUNK / 8)];
+    for (j = 0; j < MC.chunks[i]->n; j++) {
+      if (!MATCH_ROW_BIT(bits, j)) continue;
+      erow *row = &MC.chunks[i]->rows[j];
+      editorUndoRecord(UNDO_ROW, MC.first[i] + j, 0, editorRowChars(row), row->size);
+      replaced += editorRowReplace(row, q, qlen, with, wlen);
+      rows++;
+      if (first == -1) first = MC.first[i] + j;
+    }
+    MC.chunks[i]->nbytes = rowChunkBytes(MC.chunks[i], 0, MC.chunks[i]->n);
+  }
+  rowTreeFixAll(E.rows);  // Cheaper than a walk down to every changed row
+  matchCacheClear();
+  MC.useregex = useregex;
+
+  if (first != -1 && first < E.hlvalid) E.hlvalid = first;  // Syntax states are worked out again from there
+  if (E.cy < E.numrows && E.cx > editorRowAt(E.cy)->size) E.cx = editorRowAt(E.cy)->size;
+  editorSetStatusMessage("Replaced %ld in %ld lines (%.2fs)%s", replaced, rows, editorSeconds(&start),
+    undoable ? "" : " | Too big to undo");
+}
+
+void editorReplace() {
+  char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL, 0);
+  if (query == NULL) return;
+  char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1);  // Nothing deletes the matches
+  if (with) {
+    editorReplaceAll(query, with);
+    xfree(with);
+  }
+  xfree(query);
+}
+
+/* goto */
+
+void editorGoto() {  // Jumps to a line, or to a byte offset given as @OFFSET (decimal or 0x hex)
+  char *query = editorPrompt("Go to line, or @byte offset: %s (ESC to cancel)", NULL, 0);
+  if (query == NULL) return;
+
+  char *p = query[0] == '@' ? &query[1] : query;
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(p, &end, p[0] == '0' && (p[1] == 'x' || p[1] == 'X') ? 16 : 10);
+  if (!isdigit((unsigned char)p[0]) || *end != '\0' || errno) {
+    editorSetStatusMessage("Not a line or an offset: %s", query);
+    xfree(query);
+    return;
+  }
+
+  E.cx = 0;
+  if (query[0] != '@') {
+    E.cy = n > (unsigned long long)E.numrows ? E.numrows - 1 : (int)n - 1;  // Lines count from 1
+  } else if (E.numrows > 0) {
+    size_t offset = n > SIZE_MAX ? SIZE_MAX : n;
+    E.cy = rowTreeFindOffset(E.rows, &offset);
+    E.cx = editorRowCharStart(editorRowAt(E.cy), offset);
+  }
+  if (E.cy < 0) E.cy = 0;
+  E.rowoff = E.cy - E.screenrows / 2;  // Land in the middle of the screen, editorScroll() fixes it up near the ends
+  if (E.rowoff < 0) E.rowoff = 0;
+  xfree(query);
+}
+
+/* journal */
+
+// Edits go to a journal next to the file as they're made, so a crash only loses the last
+// moment of typing instead of everything since the last save. A record is one editor
+// operation and its arguments. Records are buffered and written with one fdatasync() per
+// batch: when the editor is idle, when the buffer fills up, or when the oldest record has
+// waited JOURNAL_COMMIT_MS. The header says which version of the file the edits apply to,
+// and opening that file again replays them. A save that lands starts the journal over from
+// the saved file, keeping only the edits made while it was being written.
+
+struct journal {
+  int fd;  // -1 until the first edit since the file was opened or saved
+  int enabled;  // 0 while loading and replaying, and for a new file until its first save
+  int off;  // Set by runs that only read the file, nothing is recovered or written then
+  char *path;
+  char head[JOURNAL_HEADER];  // Magic, then the size, mtime seconds and nanoseconds of the file on disk
+  char *buf;  // Records that aren't written yet
+  size_t len;
+  size_t cap;
+  size_t committed;  // Bytes of records written after the header
+  struct timespec oldest;  // When the first record in buf was made
+};
+
+struct journal J;
 
-  free(line);
-  fclose(fp);
+char *editorJournalPath(const char *filename) {  // .name.journal in the file's directory
+  const char *slash = strrchr(filename, '/');
+  const char *base = slash ? slash + 1 : filename;
+  return editorPathf("%.*s.%s.journal", (int)(base - filename), filename, base);
+}
 
-  E.dirty = 0;
+void editorJournalHeader(const char *filename) {  // Makes the header for the file as it is on disk now
+  struct stat st;
+  uint64_t head[3] = {0, 0, 0};
+  if (stat(filename, &st) == 0) {
+    head[0] = st.st_size;
+    head[1] = st.st_mtim.tv_sec;
+    head[2] = st.st_mtim.tv_nsec;
+  }
+  memcpy(J.head, JOURNAL_MAGIC, 4);
+  memcpy(&J.head[4], head, sizeof(head));
 }
 
-void editorSave() {  // Saves text to file
-  if (E.filename == NULL) {  // Prompts the user for a name if this is a new file
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) { // If user aborts
-      editorSetStatusMessage("Save aborted");
+void editorJournalFail() {  // Stops journaling after an I/O error, the file itself is fine
+  editorSetStatusMessage("Can't write journal! I/O error: %s", strerror(errno));
+  if (J.fd != -1) close(J.fd);
+  if (J.path) unlink(J.path);  // A journal with edits missing would recover the wrong text
+  J.fd = -1;
+  J.enabled = 0;
+  J.len = J.committed = 0;
+}
+
+void editorJournalCommit() {  // Writes out the buffered records and waits for them to reach the disk
+  if (J.len == 0 || J.fd == -1) return;
+  size_t off = 0;
+  while (off < J.len) {
+    ssize_t w = write(J.fd, &J.buf[off], J.len - off);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      editorJournalFail();
       return;
     }
+    off += w;
+  }
+  if (fdatasync(J.fd) == -1) {
+    editorJournalFail();
+    return;
   }
+  J.committed += J.len;
+  J.len = 0;
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);  // O_CREAT makes open() create a new file if it doesn't exist, and O_RDWR tells it to open for reading and writing
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+void editorJournal(int op, int row, int col, const char *s, int len) {  // Records an edit that's about to be made
+  if (!J.enabled) return;
+  if (J.fd == -1) {  // First edit since the file was opened or saved
+    J.fd = open(J.path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (J.fd == -1 || write(J.fd, J.head, JOURNAL_HEADER) != JOURNAL_HEADER) {
+      editorJournalFail();
+      return;
     }
-    close(fd);
+    J.committed = 0;
+  }
+
+  if (J.len + JOURNAL_RECORD + len > J.cap) {
+    J.cap = J.cap ? J.cap * 2 : JOURNAL_BUFFER;
+    if (J.cap < J.len + JOURNAL_RECORD + len) J.cap = J.len + JOURNAL_RECORD + len;
+    J.buf = xrealloc(J.buf, J.cap);
   }
+  if (J.len == 0) clock_gettime(CLOCK_MONOTONIC, &J.oldest);
+  char *p = &J.buf[J.len];
+  int32_t args[3] = {row, col, len};
+  p[0] = op;
+  memcpy(&p[1], args, sizeof(args));
+  if (len > 0) memcpy(&p[JOURNAL_RECORD], s, len);
+  J.len += JOURNAL_RECORD + len;
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  if (J.len >= JOURNAL_BUFFER || editorSeconds(&J.oldest) * 1000 >= JOURNAL_COMMIT_MS) editorJournalCommit();
 }
 
-/* find */
+int editorJournalApply(int op, int row, int col, char *s, int len) {  // Makes a recorded edit again, -1 if it doesn't fit the rows
+  erow *r = row >= 0 && row < E.numrows ? editorRowAt(row) : NULL;
+  switch (op) {
+    case JOURNAL_INSERT_ROW:
+      if (row < 0 || row > E.numrows) return -1;
+      editorInsertRow(row, s, len);
+      return 0;
+    case JOURNAL_DEL_ROW:
+      if (r == NULL) return -1;
+      editorDelRow(row);
+      return 0;
+    case JOURNAL_INSERT_CHAR:
+      if (r == NULL || col < 0 || col > r->size || len != 1) return -1;
+      editorRowInsertChar(r, col, s[0]);
+      break;
+    case JOURNAL_DEL_CHAR:
+      if (r == NULL || col < 0 || col >= r->size) return -1;
+      editorRowDelChar(r, col);
+      break;
+    case JOURNAL_APPEND:
+      if (r == NULL) return -1;
+      editorRowAppendString(r, s, len);
+      break;
+    case JOURNAL_TRUNCATE:
+      if (r == NULL || col < 0 || col > r->size) return -1;
+      editorRowTruncate(r, col);
+      break;
+    case JOURNAL_INSERT:
+      if (r == NULL || col < 0 || col > r->size) return -1;
+      editorRowInsertString(r, col, s, len);
+      break;
+    case JOURNAL_DELETE:
+      if (r == NULL || col < 0 || col + len > r->size) return -1;
+      editorRowDelString(r, col, len);
+      break;
+    case JOURNAL_REPLACE: {
+      if (col < 0 || col > len) return -1;
+      char *q = xstrndup(s, col);
+      char *with = xstrndup(&s[col], len - col);
+      editorReplaceAll(q, with);
+      xfree(q);
+      xfree(with);
+      return 0;
+    }
+    default:
+      return -1;
+  }
+  rowTreeResized(E.rows, row);
+  editorSyntaxUpdate(row);
+  return 0;
+}
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+long editorJournalReplay() {  // Starts journaling E.filename and makes the edits its journal has, returns how many
+  if (J.off) return 0;
+  xfree(J.path);
+  J.path = editorJournalPath(E.filename);
+  if (J.path == NULL) return 0;  // No journal, and nothing to recover
+  editorJournalHeader(E.filename);
+  J.enabled = 1;
 
-  if (key == '\r' || key == '\x1b') {  // return immediately instead of doing another search
-    last_match = -1;  // Reset static variables when we exit
-    direction = 1;
-    return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {  // If arrow key not pressed reset last_match to -1
-    last_match = -1;
-    direction = 1;
+  int fd = open(J.path, O_RDWR);
+  if (fd == -1) return 0;
+  char head[JOURNAL_HEADER];
+  struct stat st;
+  if (fstat(fd, &st) == -1 || read(fd, head, JOURNAL_HEADER) != JOURNAL_HEADER ||
+      memcmp(head, J.head, JOURNAL_HEADER) != 0) {
+    close(fd);  // Made against another version of the file, it's started over on the first edit
+    return 0;
   }
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;  // Allows wrapping from end of file
+  size_t n = st.st_size - JOURNAL_HEADER, got = 0;
+  char *buf = xmalloc(n ? n : 1);
+  while (got < n) {
+    ssize_t r = read(fd, &buf[got], n - got);
+    if (r <= 0) break;
+    got += r;
+  }
 
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);  // Subtract pointers to get cx
-      E.rowoff = E.numrows;  // Sets rowoff to the bottom so that when we refresh the screen, the matching line will be at the top of the screen
-      break;
-    }
+  size_t off = 0;
+  long count = 0;
+  J.enabled = 0;  // The edits are in the journal already
+  U.paused = 1;  // and they were made before this session, so they can't be undone
+  while (off + JOURNAL_RECORD <= got) {
+    int32_t args[3];
+    memcpy(args, &buf[off + 1], sizeof(args));
+    if (args[2] < 0 || (size_t)args[2] > got - off - JOURNAL_RECORD) break;  // Cut short by the crash
+    if (editorJournalApply(buf[off], args[0], args[1], &buf[off + JOURNAL_RECORD], args[2]) == -1) break;
+    off += JOURNAL_RECORD + args[2];
+    count++;
+  }
+  J.enabled = 1;
+  U.paused = 0;
+  xfree(buf);
+
+  if (off < n && ftruncate(fd, JOURNAL_HEADER + off) == -1) {  // New records go after the last good one
+    close(fd);
+    editorJournalFail();
+    return count;
   }
+  lseek(fd, JOURNAL_HEADER + off, SEEK_SET);
+  J.fd = fd;
+  J.committed = off;
+  J.len = 0;
+  return count;
 }
 
-void editorFind() {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+size_t editorJournalMark() {  // Where the journal is now, for editorJournalRebase()
+  return J.committed + J.len;
+}
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+void editorJournalRebase(const char *filename, size_t mark) {
+  // filename was just saved with every edit before mark in it. The journal starts over from it
+  // and keeps the records after mark, written to a new journal that then replaces the old one
+  if (J.path == NULL) J.path = editorJournalPath(filename);  // A new file that now has a name
+  if (J.path == NULL) {
+    editorJournalFail();
+    return;
+  }
+  J.enabled = 1;
+  editorJournalCommit();
+  editorJournalHeader(filename);
+  if (J.fd == -1 || J.committed <= mark) {  // Nothing since the snapshot, so no journal until the next edit
+    if (J.fd != -1) close(J.fd);
+    unlink(J.path);
+    J.fd = -1;
+    J.committed = 0;
+    return;
+  }
 
-  if(query) {
-    free(query);
+  size_t n = J.committed - mark;
+  char *tmp = editorPathf("%s.XXXXXX", J.path);
+  if (tmp == NULL) {
+    editorJournalFail();
+    return;
+  }
+  char *tail = xmalloc(n);
+  int fd = -1;
+  if (pread(J.fd, tail, n, JOURNAL_HEADER + mark) != (ssize_t)n || (fd = mkstemp(tmp)) == -1 ||
+      write(fd, J.head, JOURNAL_HEADER) != JOURNAL_HEADER || write(fd, tail, n) != (ssize_t)n ||
+      fdatasync(fd) == -1 || rename(tmp, J.path) == -1) {
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    editorJournalFail();
   } else {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    close(J.fd);
+    J.fd = fd;
+    J.committed = n;
   }
+  xfree(tail);
+  xfree(tmp);
+}
+
+void editorJournalDiscard() {  // Drops the journal when quitting throws the unsaved edits away
+  if (J.fd != -1) close(J.fd);
+  if (J.path) unlink(J.path);
+  J.fd = -1;
+  J.len = J.committed = 0;
 }
 
 /* append buffer */
 
-struct abuf {  // Append buffer, has a pointer to the buffer and a length
+struct abuf {  // Append buffer, has a pointer to the buffer, a length and how much room it has
   char *b;
   int len;
+  int cap;
 };
 
-#define ABUF_INIT {NULL, 0}  // Empty buffer, acts like a constructor
+#define ABUF_INIT {NULL, 0, 0}  // Empty buffer, acts like a constructor
 
 void abAppend(struct abuf *ab, const char *s, int len){
-  char *new = realloc(ab->b, ab->len + len);
+  if (ab->len + len > ab->cap) {  // Double the room so appending is amortized O(1)
+    int cap = ab->cap ? ab->cap * 2 : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = xrealloc(ab->b, cap);
 
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+    if (new == NULL) return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
 void abFree(struct abuf *ab){
-  free(ab->b);
+  xfree(ab->b);
 }
 
 /* output */
@@ -488,7 +4623,7 @@ void abFree(struct abuf *ab){
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
 
   if (E.cy < E.rowoff){
@@ -505,8 +4640,183 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct abuf *ab){
+// Drawing fills in E.frame, a grid of cells covering the text rows plus the status and message
+// bars. editorFlushFrame() then compares it with the frame the terminal is showing and only
+// sends the cells that changed.
+
+void editorFrameAlloc() {  // Sizes the frames to the screen, the next refresh redraws everything
+  size_t cells = (size_t)(E.screenrows + 2) * E.screencols;
+  E.frame.chars = xrealloc(E.frame.chars, cells);
+  E.frame.utf8 = xrealloc(E.frame.utf8, cells * sizeof(uint32_t));
+  E.frame.hl = xrealloc(E.frame.hl, cells);
+  E.lastframe.chars = xrealloc(E.lastframe.chars, cells);
+  E.lastframe.utf8 = xrealloc(E.lastframe.utf8, cells * sizeof(uint32_t));
+  E.lastframe.hl = xrealloc(E.lastframe.hl, cells);
+  E.framevalid = 0;
+}
+
+void editorFrameClear(eframe *frame, int from, int to) {  // Blanks screen rows from up to to
+  size_t start = (size_t)from * E.screencols, cells = (size_t)(to - from) * E.screencols;
+  memset(&frame->chars[start], ' ', cells);
+  memset(&frame->utf8[start], 0, cells * sizeof(uint32_t));
+  memset(&frame->hl[start], HL_NORMAL, cells);
+}
+
+int editorCellLen(uint32_t utf8) {  // Bytes of UTF-8 held in a cell
+  return utf8 < 0x100 ? 1 : utf8 < 0x10000 ? 2 : utf8 < 0x1000000 ? 3 : 4;
+}
+
+int editorDrawChar(int y, int *x, const char *s, int len, int hl) {
+  // Puts the char at the start of s, which has len bytes, in the cell at *x on screen row y and
+  // moves *x past it. Returns how many bytes of s it took. A wide char fills two cells, and a
+  // combining mark goes in with the char before it as long as they fit in one cell together
+  char *cells = &E.frame.chars[y * E.screencols];
+  uint32_t *utf8 = &E.frame.utf8[y * E.screencols];
+  unsigned char *hls = &E.frame.hl[y * E.screencols];
+  int cp;
+  int n = editorUtf8Decode(s, len, &cp);
+  if (n == 1 || cp < 0xA0) {  // ASCII, or a byte that isn't UTF-8 or a C1 control char, which would be taken as escape codes
+    cells[*x] = cp < 0 || cp >= 0x80 ? '?' : cp;
+    utf8[*x] = 0;
+    hls[(*x)++] = hl;
+    return n;
+  }
+
+  uint32_t bytes = 0;
+  int i;
+  for (i = n - 1; i >= 0; i--) bytes = bytes << 8 | (unsigned char)s[i];
+  int width = editorCharWidth(cp);
+  if (width == 0) {
+    int prev = *x - 1;
+    if (prev >= 0 && cells[prev] == FRAME_CELL_WIDE) prev--;
+    if (prev < 0) return n;
+    uint32_t base = cells[prev] == FRAME_CELL_UTF8 ? utf8[prev] : (unsigned char)cells[prev];
+    if (editorCellLen(base) + n <= 4) {
+      cells[prev] = FRAME_CELL_UTF8;
+      utf8[prev] = base | bytes << (8 * editorCellLen(base));
+    }
+    return n;
+  }
+  if (*x + width > E.screencols) {  // Doesn't fit on the row, leave the last column blank
+    cells[*x] = ' ';
+    utf8[*x] = 0;
+    hls[*x] = hl;
+    *x = E.screencols;
+    return n;
+  }
+  cells[*x] = FRAME_CELL_UTF8;
+  utf8[*x] = bytes;
+  hls[(*x)++] = hl;
+  if (width == 2) {
+    cells[*x] = FRAME_CELL_WIDE;
+    utf8[*x] = 0;
+    hls[(*x)++] = hl;
+  }
+  return n;
+}
+
+int editorDrawText(int y, int x, const char *s, int len, int hl) {  // Puts s on screen row y at column x, returns the column after it
+  if (editorIsAscii(s, len)) {  // One byte per cell
+    if (len > E.screencols - x) len = E.screencols - x;
+    if (len <= 0) return x;
+    memcpy(&E.frame.chars[y * E.screencols + x], s, len);
+    memset(&E.frame.utf8[y * E.screencols + x], 0, len * sizeof(uint32_t));
+    memset(&E.frame.hl[y * E.screencols + x], hl, len);
+    return x + len;
+  }
+  int i = 0;
+  while (i < len && x < E.screencols) i += editorDrawChar(y, &x, &s[i], len - i, hl);
+  return x;
+}
+
+
+void editorHighlightRow(const char *render, int len, unsigned char *hl) {  // Colors a row's visible chars
+  int j = 0;
+  while (j < len) {  // Whole runs at a time, digits and everything in between
+    int start = j;
+    int digit = (unsigned char)(render[j] - '0') < 10;
+    while (j < len && ((unsigned char)(render[j] - '0') < 10) == digit) j++;
+    memset(&hl[start], digit ? HL_NUMBER : HL_NORMAL, j - start);
+  }
+}
+
+void editorDrawRegexMatches(int y, erow *row) {  // editorDrawMatches() for a regex query
+  static char *marks = NULL;
+  static int markcap = 0;
+  int to = editorRowRxToCx(row, E.coloff + E.screencols) + 1;  // Matches starting further right are off screen
+  if (regexRowMatches(&MC.re, &MC.fwd, &MC.rev, row, to, regexMarks(&marks, &markcap, to)) == 0) return;
+
+  int at;
+  for (at = 0; at < to && at <= row->size; at++) {
+    if (!marks[at]) continue;
+    int len = regexMatchLen(&MC.re, &MC.fwd, row, at, to);  // Only as much as shows
+    int rx = editorRowCxToRx(row, at) - E.coloff;
+    int rxend = editorRowCxToRx(row, at + len) - E.coloff;
+    if (rx >= E.screencols || rxend <= 0) continue;
+    if (rx < 0) rx = 0;
+    if (rxend > E.screencols) rxend = E.screencols;
+    memset(&E.frame.hl[y * E.screencols + rx], HL_MATCH, rxend - rx);
+    MC.onscreen++;
+  }
+}
+
+void editorDrawMatches(int y, erow *row) {  // Marks the matches of the query that are on screen row y
+  if (MC.useregex) {
+    editorDrawRegexMatches(y, row);
+    return;
+  }
+  int at = -1;
+  while ((at = editorRowFind(row, at + 1, MC.query, MC.qlen)) != -1) {
+    int rx = editorRowCxToRx(row, at) - E.coloff;
+    if (rx >= E.screencols) break;
+    int len = editorRowCxToRx(row, at + MC.qlen) - E.coloff - rx;  // Columns, a match can have tabs or multibyte chars
+    if (rx < 0) {
+      len += rx;
+      rx = 0;
+    }
+    if (len <= 0) continue;
+    if (len > E.screencols - rx) len = E.screencols - rx;
+    memset(&E.frame.hl[y * E.screencols + rx], HL_MATCH, len);
+    MC.onscreen++;
+  }
+}
+
+void editorDrawUtf8Row(int y, int at, erow *row) {
+  // Draws row at, which has multibyte chars, on screen row y. The index gives the render byte
+  // of column E.coloff, and from there the render is decoded char by char
+  int rsize;
+  char *render = editorRowRender(row, &rsize);
+  unsigned char *hl = E.syntax && row->size <= HL_MAX_ROW ? editorRowHighlight(at, row, render, rsize) : NULL;
+  renderslot *slot = renderCacheGet(row);
+
+  int lo = 0, hi = slot->nindex;  // First entry that ends past E.coloff
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (slot->index[mid].rx <= E.coloff) lo = mid + 1;
+    else hi = mid;
+  }
+  int rb = lo == 0 ? E.coloff : slot->index[lo - 1].rb + (E.coloff - slot->index[lo - 1].rx);
+  int x = 0;
+  if (lo < slot->nindex && slot->index[lo].len > 1 && slot->index[lo].rx - slot->index[lo].width < E.coloff) {
+    x = slot->index[lo].rx - E.coloff;  // A wide char cut in half by the left edge, what's left of it stays blank
+    rb = slot->index[lo].rb;
+  }
+
+  while (x < E.screencols && rb < rsize) {
+    int h = hl ? hl[rb] : isdigit((unsigned char)render[rb]) ? HL_NUMBER : HL_NORMAL;
+    rb += editorDrawChar(y, &x, &render[rb], rsize - rb, h);
+  }
+  while (rb < rsize && x == E.screencols) {  // Marks that combine with the last char on screen
+    int cp;
+    int len = editorUtf8Decode(&render[rb], rsize - rb, &cp);
+    if (len == 1 || editorCharWidth(cp) != 0) break;
+    rb += editorDrawChar(y, &x, &render[rb], rsize - rb, HL_NORMAL);
+  }
+}
+
+void editorDrawRows(){
   int y;
+  MC.onscreen = 0;
   for (y = 0; y < E.screenrows; y++){
     int filerow = y + E.rowoff;
     if (filerow >= E.numrows) {
@@ -517,92 +4827,252 @@ void editorDrawRows(struct abuf *ab){
         if (welcomelen > E.screencols) welcomelen = E.screencols;
         // Adding padding to the welcome message
         int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) abAppend(ab, " ", 1);
-
-        abAppend(ab, welcome, welcomelen);
+        if (padding) editorDrawText(y, 0, "~", 1, HL_NORMAL);
+        editorDrawText(y, padding, welcome, welcomelen, HL_NORMAL);
       } else {
-        abAppend(ab, "~", 1);  // Write tildes for lines after end of file
+        editorDrawText(y, 0, "~", 1, HL_NORMAL);  // Write tildes for lines after end of file
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;  // Apply column offset
-      if (len < 0) len = 0;  // len might drop below 0, so we set it to 0 if that happens
-      if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      int j;
-      for (j = 0; j < len; j++){
-        if (isdigit(c[j])) {
-          abAppend(ab, "\x1b[31m", 5);
-          abAppend(ab, &c[j], 1);
-          abAppend(ab, "\x1b[39m", 5);
-        } else {
-          abAppend(ab, &c[j], 1);
-        }
+      erow *row = editorRowAt(filerow);
+      int len = E.screencols;
+      if (editorRowIsUtf8(row)) {
+        editorDrawUtf8Row(y, filerow, row);
+      } else if (E.syntax && row->size <= HL_MAX_ROW) {
+        int rsize;
+        char *render = editorRowRender(row, &rsize);
+        unsigned char *hl = editorRowHighlight(filerow, row, render, rsize);
+        int from = E.coloff < rsize ? E.coloff : rsize;  // Apply column offset
+        if (len > rsize - from) len = rsize - from;
+        memcpy(&E.frame.chars[y * E.screencols], &render[from], len);
+        memcpy(&E.frame.hl[y * E.screencols], &hl[from], len);
+      } else {
+        char *c = editorRowRenderAt(row, E.coloff, &len);  // Apply column offset, len is cut down to what's left of the row
+        memcpy(&E.frame.chars[y * E.screencols], c, len);
+        editorHighlightRow(c, len, &E.frame.hl[y * E.screencols]);
       }
+      if (MC.query) editorDrawMatches(y, row);
     }
-
-
-    abAppend(ab, "\x1b[K", 3);  // Erases the part of the current line to the right of the cursor
-
-    abAppend(ab, "\r\n", 2);
   }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);  // Change to inverted colors
-  char status[80], rstatus[80];
+void editorDrawStatusBar() {
+  int y = E.screenrows;
+  char status[80], rstatus[128];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
     E.filename ? E.filename : "[No Name]", E.numrows,
     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+  char matches[56] = "";
+  const char *mode = MC.useregex ? "regex " : "";
+  if (MC.badregex) snprintf(matches, sizeof(matches), "bad regex | ");
+  else if (MC.query) {
+    if (MC.level->total < 0) snprintf(matches, sizeof(matches), "%scounting %ld... | ", mode, __atomic_load_n(&MC.found, __ATOMIC_RELAXED));
+    else if (MC.level->total == 0) snprintf(matches, sizeof(matches), "%sno matches | ", mode);
+    else snprintf(matches, sizeof(matches), "%smatch %ld of %ld, %d on screen | ", mode, matchCountIndex(), MC.level->total, MC.onscreen);
+  }
+  char saving[24] = "";
+  if (SV.running && SV.total > 0)
+    snprintf(saving, sizeof(saving), "saving %d%% | ", (int)(__atomic_load_n(&SV.written, __ATOMIC_RELAXED) * 100 / SV.total));
+  size_t offset = rowTreeOffset(E.rows, E.cy) + E.cx;  // Where the cursor is in the file, as in Ctrl-G's @offset
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %d/%d @%zu",
+    saving, matches, E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows, offset);
+  if (rlen >= (int)sizeof(rstatus)) rlen = sizeof(rstatus) - 1;
+  if (MC.query && rlen <= E.screencols && len > E.screencols - rlen)
+    len = E.screencols - rlen;  // While searching, the match count matters more than the file name
   if (len > E.screencols) len = E.screencols; // Cut the string short if it doesn't fit
-  abAppend(ab, status, len);
 
-  while (len < E.screencols) {
-    if(E.screencols - len == rlen) {  // Keep going until we get to the point where adding rstatus would end up against the right side
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+  memset(&E.frame.hl[y * E.screencols], HL_STATUS, E.screencols);  // Inverted colors across the whole bar
+  editorDrawText(y, 0, status, len, HL_STATUS);
+  if (E.screencols - len >= rlen)  // rstatus goes against the right side if there's room for it
+    editorDrawText(y, E.screencols - rlen, rstatus, rlen, HL_STATUS);
+}
+
+void editorDrawMessageBar() {
+  int msglen = strlen(E.statusmsg);  // editorDrawText() cuts it short at the edge of the screen
+  if (msglen && time(NULL) - E.statusmsg_time < STATUS_MESSAGE_SECS) {
+    editorDrawText(E.screenrows + 1, 0, E.statusmsg, msglen, HL_NORMAL);
+  } else if (ST.overlay) {  // Messages go first, the stats show up again once they're gone
+    char stats[256];
+    int len = statFormat(stats, sizeof(stats));
+    if (len > E.screencols) len = E.screencols;
+    editorDrawText(E.screenrows + 1, 0, stats, len, HL_NORMAL);
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+void editorSetAttr(struct abuf *ab, int hl) {  // Switches the terminal over to the colors of hl
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: abAppend(ab, "\x1b[0;36m", 7); break;  // Cyan
+    case HL_KEYWORD1: abAppend(ab, "\x1b[0;33m", 7); break;  // Yellow
+    case HL_KEYWORD2: abAppend(ab, "\x1b[0;32m", 7); break;  // Green
+    case HL_STRING: abAppend(ab, "\x1b[0;35m", 7); break;  // Magenta
+    case HL_NUMBER: abAppend(ab, "\x1b[0;31m", 7); break;  // Red
+    case HL_MATCH: abAppend(ab, "\x1b[0;34m", 7); break;  // Blue
+    case HL_STATUS: abAppend(ab, "\x1b[0;7m", 6); break;  // Inverted colors
+    default: abAppend(ab, "\x1b[m", 3); break;
+  }
 }
 
-void editorRefreshScreen() {
-  editorScroll();
+void editorMoveTo(struct abuf *ab, int y, int x) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+}
+
+void editorScrollFrame(struct abuf *ab) {
+  // If the text only moved up or down since the last frame, have the terminal shift what it
+  // already shows (DECSTBM scroll region plus SU/SD), and shift E.lastframe to match. Then
+  // only the rows that scrolled into view differ
+  int d = E.rowoff - E.lastrowoff;
+  if (!E.framevalid || !E.scrollregion || d == 0 || E.coloff != E.lastcoloff) return;
+  if (d >= E.screenrows || -d >= E.screenrows) return;
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+    E.screenrows, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+
+  int moved = E.screenrows - (d > 0 ? d : -d);  // Rows still on screen after scrolling
+  size_t from = (d > 0 ? d : 0) * E.screencols, to = (d > 0 ? 0 : -d) * E.screencols;
+  memmove(&E.lastframe.chars[to], &E.lastframe.chars[from], (size_t)moved * E.screencols);
+  memmove(&E.lastframe.utf8[to], &E.lastframe.utf8[from], (size_t)moved * E.screencols * sizeof(uint32_t));
+  memmove(&E.lastframe.hl[to], &E.lastframe.hl[from], (size_t)moved * E.screencols);
+  if (d > 0) editorFrameClear(&E.lastframe, moved, E.screenrows);  // Scrolled in rows come up blank
+  else editorFrameClear(&E.lastframe, 0, -d);
+}
+
+void editorAppendCells(struct abuf *ab, const char *chars, const uint32_t *utf8, int n) {  // Appends what n cells hold
+  if (editorIsAscii(chars, n)) {  // No multibyte chars, the cells are the bytes to send
+    abAppend(ab, chars, n);
+    return;
+  }
+  char buf[256];
+  int len = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    if (len > (int)sizeof(buf) - 4) {
+      abAppend(ab, buf, len);
+      len = 0;
+    }
+    if (chars[i] == FRAME_CELL_UTF8) {
+      uint32_t bytes = utf8[i];
+      do {
+        buf[len++] = bytes & 0xFF;
+        bytes >>= 8;
+      } while (bytes);
+    } else if (chars[i] != FRAME_CELL_WIDE) {  // The terminal already moved past those with the wide char
+      buf[len++] = chars[i];
+    }
+  }
+  abAppend(ab, buf, len);
+}
+
+void editorFlushFrame(struct abuf *ab) {
+  // Sends the cells of E.frame that differ from E.lastframe, one append and at most one color
+  // change per run of same colored cells. Unchanged runs shorter than FRAME_SKIP are sent
+  // again anyway, since jumping over them costs about as much
+  int rows = E.screenrows + 2;
+  int attr = -1;  // What the terminal is drawing with right now, -1 if we don't know
+  int y;
 
-  struct abuf ab = ABUF_INIT;
+  if (!E.framevalid) {  // No idea what's on screen, so clear it and diff against a blank frame
+    abAppend(ab, "\x1b[m\x1b[2J", 7);
+    attr = HL_NORMAL;
+    editorFrameClear(&E.lastframe, 0, rows);
+    E.framevalid = 1;
+  }
 
-  abAppend(&ab, "\x1b[?25l", 6); // Hides cursor before we clear the screen
+  for (y = 0; y < rows; y++) {
+    char *chars = &E.frame.chars[y * E.screencols], *oldchars = &E.lastframe.chars[y * E.screencols];
+    uint32_t *utf8 = &E.frame.utf8[y * E.screencols], *oldutf8 = &E.lastframe.utf8[y * E.screencols];
+    unsigned char *hl = &E.frame.hl[y * E.screencols], *oldhl = &E.lastframe.hl[y * E.screencols];
+    if (memcmp(chars, oldchars, E.screencols) == 0 && memcmp(hl, oldhl, E.screencols) == 0 &&
+        memcmp(utf8, oldutf8, E.screencols * sizeof(uint32_t)) == 0) continue;
 
-  abAppend(&ab, "\x1b[H", 3);  // Positions cursor at top left of screen using the H command
+    int blank = E.screencols;  // Everything from here to the end of the row is empty
+    while (blank > 0 && chars[blank - 1] == ' ' && hl[blank - 1] == HL_NORMAL) blank--;
 
-  editorDrawRows(&ab);  // Add stuff to buffer
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+    int x = 0;
+    while (x < E.screencols) {
+      if (chars[x] == oldchars[x] && hl[x] == oldhl[x] && utf8[x] == oldutf8[x]) {
+        x++;
+        continue;
+      }
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1); // Moves the cursor to its position
-  abAppend(&ab, buf, strlen(buf));
+      if (x > 0 && chars[x] == FRAME_CELL_WIDE) x--;  // Only the right half changed, send the whole char
+      editorMoveTo(ab, y, x);
+      if (x >= blank) {  // Only blanks left, erase the rest of the line instead of sending them
+        if (attr != HL_NORMAL) editorSetAttr(ab, HL_NORMAL);
+        attr = HL_NORMAL;
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+
+      int end = x;
+      int same = 0;  // Unchanged cells at the end of the span
+      while (end < blank && same < FRAME_SKIP) {
+        same = (chars[end] == oldchars[end] && hl[end] == oldhl[end] && utf8[end] == oldutf8[end]) ? same + 1 : 0;
+        end++;
+      }
+      end -= same;
+
+      while (x < end) {
+        int run = x + 1;
+        while (run < end && hl[run] == hl[x]) run++;
+        if (hl[x] != attr) editorSetAttr(ab, hl[x]);
+        attr = hl[x];
+        editorAppendCells(ab, &chars[x], &utf8[x], run - x);
+        x = run;
+      }
+    }
+  }
+  if (attr != HL_NORMAL && attr != -1) editorSetAttr(ab, HL_NORMAL);
+
+  eframe swap = E.lastframe;  // What we just drew is now on screen
+  E.lastframe = E.frame;
+  E.frame = swap;
+  E.lastrowoff = E.rowoff;
+  E.lastcoloff = E.coloff;
+}
+
+void editorRefreshScreen() {
+  static struct abuf ab = ABUF_INIT;  // Kept between frames so its memory gets reused
+  ab.len = 0;
+
+  uint64_t t = statNow();
+  editorScroll();
+  t = statAdd(STAT_SCROLL, t);
+
+  editorFrameClear(&E.frame, 0, E.screenrows + 2);
+  t = statNow();
+  editorDrawRows();
+  statAdd(STAT_DRAWROWS, t);
+  editorDrawStatusBar();
+  editorDrawMessageBar();
 
-  abAppend(&ab, "\x1b[?25h", 6); // Unhides the cursor
+  abAppend(&ab, "\x1b[?25l", 6); // Hides cursor while we draw
+  editorScrollFrame(&ab);
+  editorFlushFrame(&ab);
+
+  int cursory = E.cy - E.rowoff, cursorx = E.rx - E.coloff;
+  if (ab.len == 6) {  // Nothing changed on screen
+    ab.len = 0;
+    if (cursory != E.cursory || cursorx != E.cursorx) editorMoveTo(&ab, cursory, cursorx);
+  } else {
+    editorMoveTo(&ab, cursory, cursorx);  // Moves the cursor to its position
+    abAppend(&ab, "\x1b[?25h", 6); // Unhides the cursor
+  }
+  E.cursory = cursory;
+  E.cursorx = cursorx;
 
-  write(STDOUT_FILENO, ab.b, ab.len);  // write stuff from buffer
-  abFree(&ab);
+  if (ab.len) {
+    t = statNow();
+    write(STDOUT_FILENO, ab.b, ab.len);  // write stuff from buffer
+    statAdd(STAT_WRITE, t);
+  }
+  E.frames++;
+  E.framebytes = ab.len;
+  E.totalbytes += ab.len;
+  if (R.waiting) editorReplayLatency();
 }
 
 void editorSetStatusMessage(const char *fmt, ...){
@@ -615,9 +5085,50 @@ void editorSetStatusMessage(const char *fmt, ...){
 
 /* input */
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {  // Prompt for input on things like name when saving to a file
+int editorWaitTimeout() {  // How long the main thread can sleep in ms, -1 if nothing's due
+  if (SV.running || (MC.query && MC.level->total == -1)) return PROGRESS_MS;
+  if (E.statusmsg[0] == '\0') return -1;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  long left = (E.statusmsg_time + STATUS_MESSAGE_SECS - now.tv_sec) * 1000L - now.tv_nsec / 1000000;
+  return left > 0 ? left : -1;  // Wake up when the message is due to go
+}
+
+void editorResize() {  // Sizes the screen to the terminal again
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1) return;
+  E.screenrows -= 2;
+  if (E.screenrows < 1) E.screenrows = 1;
+  editorFrameAlloc();
+}
+
+int editorWaitForEvent() {
+  // Sleeps until there's input, the terminal is resized, a timer runs out or a background
+  // thread has news. Returns 1 if there's something new to show, 0 if it's input
+  editorJournalCommit();  // Going idle, so it's a good time to put recent edits on disk
+  struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {W.pipe[0], POLLIN, 0}};
+  int n = poll(fds, W.pipe[0] == -1 ? 1 : 2, editorWaitTimeout());
+  if (n == -1 && errno != EINTR) die("poll");
+  if (n > 0 && (fds[1].revents & POLLIN)) {
+    char buf[64];
+    while (read(W.pipe[0], buf, sizeof(buf)) > 0);
+  }
+
+  int news = n == 0;  // A timer ran out
+  if (W.resized) {
+    W.resized = 0;
+    editorResize();
+    news = 1;
+  }
+  news |= matchCountPoll();
+  news |= editorSavePoll();
+  return news;
+}
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowempty) {
+  // Prompt for input on things like name when saving to a file. Enter on an empty input only
+  // returns it when allowempty is set, otherwise it keeps waiting
   size_t bufsize = 128;
-  char *buf = malloc(bufsize);
+  char *buf = xmalloc(bufsize);
 
   size_t buflen = 0;
   buf[0] = '\0';
@@ -628,25 +5139,38 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {  // Prompt for
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-      if (buflen != 0) buf[--buflen] = '\0';
+      while (buflen != 0 && (buf[--buflen] & 0xC0) == 0x80);  // All the bytes of the last char
+      buf[buflen] = '\0';
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
       if (callback) callback(buf, c); // Caller can pass in NULL if they don't want to use callback
-      free(buf);
+      xfree(buf);
       return NULL;
     } else if (c == '\r') { // If user presses enter
-      if (buflen != 0) {  // input cannot be empty
+      if (buflen != 0 || allowempty) {
         editorSetStatusMessage("");
         if (callback) callback(buf, c);
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {  // Not control and input key < 128 (in range of char)
+    } else if (c < 256 && !iscntrl(c)) {  // Not control and in range of char, bytes of UTF-8 chars included
       if (buflen == bufsize - 1) {
         bufsize *= 2;
-        buf = realloc(buf, bufsize);
+        buf = xrealloc(buf, bufsize);
       }
       buf[buflen++] = c;
       buf[buflen] = '\0';
+    } else if (c == PASTE_EVENT) {  // Pasted text goes in as if it was typed, without its line breaks
+      int i;
+      for (i = 0; i < IN.pastelen; i++) {
+        unsigned char p = IN.paste[i];
+        if (iscntrl(p)) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = xrealloc(buf, bufsize);
+        }
+        buf[buflen++] = p;
+      }
+      buf[buflen] = '\0';
     }
 
     if (callback) callback(buf, c);
@@ -654,20 +5178,22 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {  // Prompt for
 }
 
 void editorMoveCursor(int key){
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = editorRowAt(E.cy);  // NULL if the cursor is past the last line
+  int vertical = key == ARROW_UP || key == ARROW_DOWN;
+  int rx = row && vertical ? editorRowCxToRx(row, E.cx) : 0;  // Going up or down keeps the cursor in its column
 
   switch (key){
     case ARROW_LEFT:
       if (E.cx != 0){
-        E.cx--;
-      } else if (E.cy >= 0) {  // Moves up to the previous line if at the end 
+        E.cx = editorRowPrevChar(row, E.cx);
+      } else if (E.cy > 0) {  // Moves up to the previous line if at the end 
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       }
       break;
     case ARROW_RIGHT:
       if (row && E.cx < row->size) { // Only move right if cursor is to the left of the end of the line
-        E.cx++;
+        E.cx = editorRowNextChar(row, E.cx);
       } else if (row && E.cx == row->size){ // Make sur cursor not at end of file before moving down
         E.cy++;
         E.cx = 0;
@@ -686,7 +5212,8 @@ void editorMoveCursor(int key){
   }
 
   // Set row again and set E.cx to the end of the line if it is to the right of the end of the line
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = editorRowAt(E.cy);
+  if (vertical) E.cx = row ? editorRowRxToCx(row, rx) : 0;
   int rowlen = row ? row->size : 0;  // NULL is considered 0 here
   if (E.cx > rowlen) {
     E.cx = rowlen;
@@ -705,14 +5232,18 @@ void editorProcessKeypress(){  // Waits for a keypress, then handles it.
 
     case CTRL_KEY('q'):
       // We don't use atexit() to clear the screen when program exits so that the error message printed by die() doesn't get erased
+      editorSaveWait();  // Don't leave a half written file behind
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes."
           "Press Ctrl-Q %d more times to quit.", quit_times);
         quit_times--;
         return;
       }
+      editorJournalDiscard();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
+      if (getenv("CEDITOR_STATS_JSON")) editorStatsDump();  // Before editorClose() empties the text allocator
+      editorClose();
       exit(0);
       break;
 
@@ -721,18 +5252,33 @@ void editorProcessKeypress(){  // Waits for a keypress, then handles it.
       break;
 
     case HOME_KEY:
+      editorUndoBreak();
       E.cx = 0; // Home key sends cursor to left
       break;
 
     case END_KEY:
+      editorUndoBreak();
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;  // End key sends cursor to right
+        E.cx = editorRowAt(E.cy)->size;  // End key sends cursor to right
       break;
 
     case CTRL_KEY('f'):
+      editorUndoBreak();
       editorFind();  // Search function
       break;
 
+    case CTRL_KEY('r'):
+      editorReplace();
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -743,28 +5289,50 @@ void editorProcessKeypress(){  // Waits for a keypress, then handles it.
     case PAGE_UP:
     case PAGE_DOWN:
       {
-        if (c == PAGE_UP) {
-          E.cy = E.rowoff;
-        } else if (c == PAGE_DOWN) {
-          E.cy = E.rowoff + E.screenrows - 1;
+        editorUndoBreak();
+        erow *row = editorRowAt(E.cy);
+        int rx = row ? editorRowCxToRx(row, E.cx) : 0;  // The cursor stays in its column
+        if (c == PAGE_UP) {  // A screen up from the top of the screen
+          E.cy = E.rowoff - E.screenrows;
+          if (E.cy < 0) E.cy = 0;
+        } else {  // A screen down from the bottom of the screen
+          E.cy = E.rowoff + 2 * E.screenrows - 1;
           if (E.cy > E.numrows) E.cy = E.numrows;
         }
 
-        int times = E.screenrows;  // Move the cursor up or down as many times as there are screenrows
-        while(times--)
-          editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN); // Move up if page up and move down if page down
+        row = editorRowAt(E.cy);
+        E.cx = row ? editorRowRxToCx(row, rx) : 0;
       }
       break;
 
+    case CTRL_KEY('g'):
+      editorUndoBreak();
+      editorGoto();
+      break;
+
     case ARROW_UP:
     case ARROW_DOWN:
     case ARROW_LEFT:
     case ARROW_RIGHT:
+      editorUndoBreak();
       editorMoveCursor(c);
       break;
 
-    case CTRL_KEY('l'):
+    case PASTE_EVENT:
+      editorInsertText(IN.paste, IN.pastelen);
+      break;
+
+    case CTRL_KEY('p'):  // Stats overlay on or off
+      ST.overlay = !ST.overlay;
+      editorSetStatusMessage("");  // Out of the overlay's way
+      break;
+
+    case CTRL_KEY('l'):  // Redraws the whole screen in case something else wrote to it
+      E.framevalid = 0;
+      break;
+
     case '\x1b':
+    case BG_EVENT:
       break;
 
     default:
@@ -784,28 +5352,264 @@ void initEditor() { // Initializes all fields in the E struct except termios
   E.cy = 0;
   E.rowoff = 0;
   E.coloff = 0;
-  E.row = NULL;
+  E.rows = NULL;
+  E.rowcache = NULL;
+  E.rowcache_start = 0;
   E.dirty = 0;
   E.filename = NULL;
+  E.syntax = NULL;
+  E.hlvalid = 0;
+  E.map = NULL;
+  E.maplen = 0;
+  J.fd = -1;
+  renderCacheInit();
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
   E.screenrows -= 2; // Last 2 rows are reserved for status bar and status message
+
+  E.frame.chars = E.lastframe.chars = NULL;
+  E.frame.utf8 = E.lastframe.utf8 = NULL;
+  E.frame.hl = E.lastframe.hl = NULL;
+  E.cursory = E.cursorx = -1;
+  E.lastrowoff = E.lastcoloff = 0;
+  char *term = getenv("TERM");
+  E.scrollregion = term && strcmp(term, "dumb") != 0;  // Anything else speaks enough VT100 for scroll regions
+  E.frames = 0;
+  E.totalbytes = E.framebytes = 0;
+  editorFrameAlloc();
+}
+
+int editorBenchRegex(const char *pattern, char *filename) {
+  // ceditor --bench-regex PATTERN FILE: counts the lines of FILE matching PATTERN with the
+  // editor's regex engine and with regexec(), and prints how long each took. The counts are
+  // only held against each other when PATTERN means the same to both, regcomp() has no \d,
+  // \w, \s or \t
+  regex re;
+  regex_t posix;
+  if (regexCompile(&re, pattern) == -1 || regcomp(&posix, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+    fprintf(stderr, "bad regex: %s\n", pattern);
+    return 1;
+  }
+  int same = 1;
+  const char *p;
+  for (p = pattern; *p; p++) {
+    if (*p != '\\' || !p[1]) continue;
+    if (isalnum((unsigned char)p[1])) same = 0;  // \d and the rest, or a letter that stands for itself to one of them
+    p++;
+  }
+  R.rows = 24;  // Headless, and the file is left as it is on disk
+  R.cols = 80;
+  J.off = 1;
+  initEditor();
+  editorOpen(filename);
+
+  struct timespec start;
+  redfa rev;
+  long lines = 0;
+  int at, m;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  regexDfaInit(&rev, &re.rev);
+  for (at = 0; at < E.numrows; at++) {
+    regexRowStarts(&re, &rev, editorRowAt(at), 0, INT_MAX, NULL, &m, NULL);
+    if (m != -1) lines++;
+  }
+  double dfa = editorSeconds(&start);
+
+  char *line = NULL;  // regexec() wants each row on its own, ending in a NUL
+  int linecap = 0;
+  long plines = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (at = 0; at < E.numrows; at++) {
+    erow *row = editorRowAt(at);
+    if (row->size >= linecap) {
+      linecap = row->size * 2 + 1;
+      line = xrealloc(line, linecap);
+    }
+    memcpy(line, editorRowChars(row), row->size);
+    line[row->size] = '\0';
+    if (regexec(&posix, line, 0, NULL, 0) == 0) plines++;
+  }
+  double libc = editorSeconds(&start);
+
+  printf("%d lines\n", E.numrows);
+  printf("dfa:     %ld matching lines in %.3fs, %ld dfa states, %ld flushes\n", lines, dfa, (long)rev.nstates, rev.flushes);
+  printf("regexec: %ld matching lines in %.3fs%s\n", plines, libc, same ? "" : " (not compared, the pattern reads differently)");
+  xfree(line);
+  regexDfaFree(&rev);
+  regexFree(&re);
+  regfree(&posix);
+  return same && lines != plines;
+}
+
+void editorStatsDump() {  // Writes the stats to $CEDITOR_STATS_JSON, once, when quitting or at exit
+  static int dumped = 0;
+  if (dumped) return;
+  dumped = 1;
+  FILE *fp = fopen(getenv("CEDITOR_STATS_JSON"), "w");
+  if (!fp) return;
+  fprintf(fp, "{\n  \"version\": \"%s\",\n  \"timers\": {\n", EDITOR_VERSION);
+  int i;
+  for (i = 0; i < STAT_TIMERS; i++) {
+    struct statTime *t = &ST.timers[i];
+    fprintf(fp, "    \"%s\": {\"calls\": %ld, \"total_ns\": %llu, \"max_ns\": %llu}%s\n", STAT_NAMES[i],
+      t->calls, (unsigned long long)t->ns, (unsigned long long)t->maxns, i < STAT_TIMERS - 1 ? "," : "");
+  }
+  fprintf(fp, "  },\n  \"mallocs\": %ld,\n  \"reallocs\": %ld,\n  \"frees\": %ld,\n  \"allocated_bytes\": %llu,\n",
+    ST.mallocs, ST.reallocs, ST.frees, (unsigned long long)ST.allocated);
+  fprintf(fp, "  \"text\": {\"allocator\": \"%s\", \"allocs\": %ld, \"frees\": %ld, \"recycled\": %ld, \"large\": %ld, "
+    "\"requested\": %zu, \"in_use\": %zu, \"peak\": %zu, \"reserved\": %zu},\n",
+#ifdef TEXT_PLAIN_MALLOC
+    "plain malloc",
+#else
+    "size classes",
+#endif
+    TA.stats.allocs, TA.stats.frees, TA.stats.recycled, TA.stats.large,
+    TA.stats.requested, TA.stats.inuse, TA.stats.peak, TA.stats.reserved);
+  fprintf(fp, "  \"render_cache\": {\"hits\": %ld, \"misses\": %ld},\n", RC.hits, RC.misses);
+  fprintf(fp, "  \"frames\": %ld,\n  \"frame_bytes\": %zu,\n  \"last_frame_bytes\": %zu\n}\n",
+    E.frames, E.totalbytes, E.framebytes);
+  fclose(fp);
+}
+
+int editorCompareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+void editorReplayReport() {  // Prints what a headless run measured, at exit
+  if (R.nlat > 0) {
+    qsort(R.lat, R.nlat, sizeof(double), editorCompareDoubles);
+    fprintf(stderr, "%d keys: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", R.nlat,
+      R.lat[(R.nlat - 1) / 2] * 1e3, R.lat[(int)((R.nlat - 1) * 0.99)] * 1e3, R.lat[R.nlat - 1] * 1e3);
+  }
+  if (R.loadsecs > 0)
+    fprintf(stderr, "load: %zu bytes in %.3fs (%.0f MB/s)\n", R.loaded, R.loadsecs, R.loaded / R.loadsecs / 1e6);
+  if (R.savesecs > 0)
+    fprintf(stderr, "save: %zu bytes in %.3fs (%.0f MB/s)\n", R.saved, R.savesecs, R.saved / R.savesecs / 1e6);
+}
+
+void editorReplayLatency() {  // A frame is done, so the key that led to it is too
+  if (R.nlat == R.latcap) {
+    R.latcap = R.latcap ? R.latcap * 2 : 1024;
+    R.lat = xrealloc(R.lat, sizeof(double) * R.latcap);
+  }
+  R.lat[R.nlat++] = editorSeconds(&R.keystart);
+  R.waiting = 0;
+}
+
+void editorReplayEnd() {  // The key script ran out, so the run is over
+  editorSaveWait();
+  editorJournalDiscard();  // The next run shouldn't start by recovering this one's edits
+  exit(0);
+}
+
+size_t editorReplayKeys(char *buf, size_t cap) {
+  // Copies the next bytes of the key script to buf, up to cap of them and no further than the
+  // next pause. Waits out a pause once the keys before it are used up, and ends the run when
+  // there are no keys left
+  while (R.pause < R.npauses && R.pauses[R.pause] == R.pos) {
+    editorSaveWait();
+    if (MC.nthreads) matchCountWait();
+    R.pause++;
+  }
+  if (R.pos == R.len) editorReplayEnd();
+  size_t end = R.pause < R.npauses ? R.pauses[R.pause] : R.len;
+  size_t n = end - R.pos < cap ? end - R.pos : cap;
+  memcpy(buf, &R.keys[R.pos], n);
+  R.pos += n;
+  return n;
+}
+
+int editorReplay(int argc, char *argv[]) {
+  // ceditor --replay KEYS [--size ROWSxCOLS] [--out OUT] [FILE]: runs the editor without a
+  // terminal, on keys read from the file KEYS, where a line feed is Enter. The screen is
+  // ROWSxCOLS (24x80 unless given) and is written to OUT (/dev/null unless given). Reports
+  // the latency of every key, from reading it to the end of the frame it caused, and how
+  // fast FILE was loaded and saved. Keys come in faster than a save or a match count can
+  // finish, so ESC ]wait BEL in KEYS, which no terminal sends, waits for the ones in
+  // progress instead of being keys
+  char *out = "/dev/null", *filename = NULL;
+  R.rows = 24;
+  R.cols = 80;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &R.rows, &R.cols) != 2 || R.rows < 3 || R.cols < 1) {
+        fprintf(stderr, "bad size: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      out = argv[++i];
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  FILE *fp = fopen(argv[0], "r");
+  if (!fp) die("fopen");
+  size_t cap = 4096;
+  R.keys = xmalloc(cap);
+  size_t n;
+  while ((n = fread(&R.keys[R.len], 1, cap - R.len, fp)) > 0) {
+    R.len += n;
+    if (R.len == cap) R.keys = xrealloc(R.keys, cap *= 2);
+  }
+  fclose(fp);
+  static const char pause[] = "\x1b]wait\a";
+  size_t to = 0;
+  for (n = 0; n < R.len; n++) {
+    if (R.len - n >= sizeof(pause) - 1 && memcmp(&R.keys[n], pause, sizeof(pause) - 1) == 0) {
+      R.pauses = xrealloc(R.pauses, sizeof(size_t) * (R.npauses + 1));
+      R.pauses[R.npauses++] = to;
+      n += sizeof(pause) - 2;
+      continue;
+    }
+    R.keys[to++] = R.keys[n] == '\n' ? '\r' : R.keys[n];  // What the terminal sends for Enter
+  }
+  R.len = to;
+
+  int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1) die(out);
+  close(fd);
+
+  editorWakeInit();
+  initEditor();
+  if (filename) {
+    struct stat st;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    editorOpen(filename);
+    R.loadsecs = editorSeconds(&start);
+    R.loaded = stat(filename, &st) == 0 ? st.st_size : 0;
+  }
+  atexit(editorReplayReport);  // Ctrl-Q in the script ends the run too
+
+  while (1) {  // Like the main loop, but with a frame for every key
+    editorRefreshScreen();
+    editorProcessKeypress();
+  }
 }
 
 int main(int argc, char *argv[]){
+  if (getenv("CEDITOR_STATS_JSON")) atexit(editorStatsDump);
+  if (argc == 4 && strcmp(argv[1], "--bench-regex") == 0) return editorBenchRegex(argv[2], argv[3]);
+  if (argc >= 3 && strcmp(argv[1], "--replay") == 0) return editorReplay(argc - 2, &argv[2]);
+
   enableRawMode();
+  editorWakeInit();
   initEditor();
+  editorSetStatusMessage("HELP: ^S save ^Q quit ^F find ^R replace ^Z undo ^Y redo ^G go to ^P stats ^L redraw");
   if (argc >= 2){
-    editorOpen(argv[1]);
+    editorOpen(argv[1]);  // Can replace the help with news of recovered edits
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
-
   while (1){
     editorRefreshScreen();
-    editorProcessKeypress();
+    do {
+      editorProcessKeypress();
+    } while (editorInputPending());  // One frame for everything that came in together
   }
   return 0;
 }